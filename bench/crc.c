@@ -0,0 +1,114 @@
+// Frame check sequence cost: ms per MB of each FcsMode against the byte at a
+// time XOR BCC2 llwrite and llread used to run, on its own and folded into
+// stuffing the way bstuff does it.
+//
+// usage: bench/crc
+// build: gcc -Wall -O2 -o bin/bench_crc bench/crc.c src/*.c -Iinclude -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc.h"
+#include "stuffing.h"
+
+#define SIZE (1024 * 1024)
+#define ROUNDS 64
+
+static double now_s(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+// BCC2 as llwrite computed it before the FCS modes
+static unsigned char bcc2_bytewise(const unsigned char* buf, size_t size) {
+
+    unsigned char bcc2 = buf[0];
+    for (size_t i = 1; i < size; i++) {
+        bcc2 ^= buf[i];
+    }
+
+    return bcc2;
+
+}
+
+// volatile so the compiler keeps every round
+static volatile uint32_t sink;
+
+static double bytewise_ms(const unsigned char* data) {
+
+    double best = 1e9;
+    for (int r = 0; r < ROUNDS; r++) {
+        double start = now_s();
+        sink = bcc2_bytewise(data, SIZE);
+        double ms = (now_s() - start) * 1e3;
+        if (ms < best) best = ms;
+    }
+
+    return best;
+
+}
+
+static double fcs_ms(const unsigned char* data, FcsMode mode) {
+
+    double best = 1e9;
+    for (int r = 0; r < ROUNDS; r++) {
+        double start = now_s();
+        sink = fcs_update(mode, fcs_init(mode), data, SIZE);
+        double ms = (now_s() - start) * 1e3;
+        if (ms < best) best = ms;
+    }
+
+    return best;
+
+}
+
+// stuff_span with the FCS advanced chunk by chunk, or plain stuffing when
+// fcs is NULL
+static double stuff_ms(const unsigned char* data, unsigned char* out, FcsMode mode, uint32_t* fcs) {
+
+    double best = 1e9;
+    for (int r = 0; r < ROUNDS; r++) {
+        double start = now_s();
+        if (fcs != NULL) *fcs = fcs_init(mode);
+        sink = stuff_span(out, data, SIZE, mode, fcs);
+        double ms = (now_s() - start) * 1e3;
+        if (ms < best) best = ms;
+    }
+
+    return best;
+
+}
+
+int main(void) {
+
+    unsigned char* data = malloc(SIZE);
+    unsigned char* out = malloc(2 * SIZE);
+
+    srand(1);
+    for (size_t i = 0; i < SIZE; i++) data[i] = rand();
+
+    printf("ms per MB, best of %d\n\n", ROUNDS);
+
+    double plain = stuff_ms(data, out, FCS_XOR, NULL);
+    printf("%-22s %6.3f   stuffing alone %.3f\n", "XOR BCC2, bytewise", bytewise_ms(data), plain);
+
+    for (FcsMode mode = FCS_XOR; mode <= FCS_CRC32C; mode++) {
+        uint32_t fcs;
+        double alone = fcs_ms(data, mode);
+        double stuffed = stuff_ms(data, out, mode, &fcs);
+        printf("%-22s %6.3f   stuffing with it %.3f (+%.3f)\n", fcs_name(mode), alone, stuffed, stuffed - plain);
+    }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    printf("\nCRC-32C uses %s\n", __builtin_cpu_supports("sse4.2") ? "the SSE4.2 crc32 instruction" : "slicing-by-8 tables");
+#endif
+
+    free(data);
+    free(out);
+    return 0;
+
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Frame size sweep: sends a 4 MB random file over tests/bridge.py once per
+# FRAME_PAYLOAD and bit error rate, with the payload neither capped by the
+# nominal baud rate nor changed by the quality monitor, and prints the wall
+# time and transmitter/receiver CPU time per MB.
+#
+# usage: bench/framesize.sh [PAYLOAD ...]
+# BERS lists the bit error rates, "0 1e-6 1e-5" by default, and RATE limits
+# the line in bytes per second, unlimited by default.
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+work=$(mktemp -d)
+bridge=
+
+trap '[ -n "$bridge" ] && kill $bridge 2>/dev/null; rm -rf "$work"' EXIT
+
+export RATE=${RATE:-0}
+payloads=${@:-404 1024 4096 16384 65539}
+bers=${BERS:-0 1e-6 1e-5}
+
+head -c 4000000 /dev/urandom > "$work/data.bin"
+cd "$work"
+
+# run BIN BER: seconds and CPU ms per MB on both ends, or failed
+run() {
+
+    rm -f ttyA ttyB data-received.bin
+    BER=$2 python3 "$root/tests/bridge.py" "$work" & bridge=$!
+    while [ ! -e ttyB ]; do sleep 0.1; done
+
+    timeout 150 "./$1" "$work/ttyB" rx data.bin > rx.log 2>&1 & receiver=$!
+    sleep 0.3
+    local start=$(date +%s%N)
+    timeout 150 "./$1" "$work/ttyA" tx data.bin > tx.log 2>&1
+    wait $receiver
+    local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    kill $bridge; wait $bridge 2>/dev/null; bridge=
+
+    if cmp -s data.bin data-received.bin; then
+        local cpu="s/^CPU time per MB: \([0-9.]*\) ms$/\1/p"
+        printf "%d.%02ds %s/%s" $((ms / 1000)) $((ms % 1000 / 10)) "$(sed -n "$cpu" tx.log)" "$(sed -n "$cpu" rx.log)"
+    else
+        echo "failed"
+    fi
+
+}
+
+printf "%-8s" payload
+for ber in $bers; do printf " %-20s" "BER $ber"; done
+echo
+
+for payload in $payloads; do
+
+    gcc -Wall -O2 -DFRAME_PAYLOAD=$payload -DPAYLOAD_CAP=0 -DLINK_ADAPT=0 -o "main$payload" \
+        "$root/main.c" "$root"/src/*.c -I"$root/include" -lpthread || exit 1
+
+    printf "%-8s" $payload
+    for ber in $bers; do printf " %-20s" "$(run main$payload $ber)"; done
+    echo
+
+done
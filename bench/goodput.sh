@@ -0,0 +1,58 @@
+#!/bin/bash
+# Goodput against bit error rate, with and without Reed-Solomon FEC: sends a
+# 1 MB random file over tests/bridge.py at RATE bytes per second while it
+# flips bits in both directions.
+#
+# usage: bench/goodput.sh [BER ...]
+# RATE sets the line speed, 200000 by default, and PARITY the RS parity
+# bytes of the FEC build, 16 by default.
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+work=$(mktemp -d)
+bridge=
+
+trap '[ -n "$bridge" ] && kill $bridge 2>/dev/null; rm -rf "$work"' EXIT
+
+export RATE=${RATE:-200000}
+parity=${PARITY:-16}
+rates=${@:-0 1e-5 3e-5 1e-4 3e-4}
+
+build() {
+    gcc -Wall -O2 "$@" "$root/main.c" "$root"/src/*.c -I"$root/include" -lpthread || exit 1
+}
+
+build -o "$work/plain"
+build -o "$work/fec" -DFEC_PARITY=$parity
+
+head -c 1000000 /dev/urandom > "$work/data.bin"
+cd "$work"
+
+# goodput BIN BER: KB/s of file delivered intact, or failed
+goodput() {
+
+    rm -f ttyA ttyB data-received.bin
+    BER=$2 python3 "$root/tests/bridge.py" "$work" & bridge=$!
+    while [ ! -e ttyB ]; do sleep 0.1; done
+
+    timeout 150 "./$1" "$work/ttyB" rx data.bin > rx.log 2>&1 & receiver=$!
+    sleep 0.3
+    local start=$(date +%s%N)
+    timeout 150 "./$1" "$work/ttyA" tx data.bin > tx.log 2>&1
+    wait $receiver
+    local ms=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    kill $bridge; wait $bridge 2>/dev/null; bridge=
+
+    if cmp -s data.bin data-received.bin; then
+        echo "$(( 1000000 * 1000 / ms / 1024 )) KB/s"
+    else
+        echo "failed"
+    fi
+
+}
+
+printf "%-8s %-12s %s\n" BER plain "RS(255,$((255 - parity)))"
+for ber in $rates; do
+    printf "%-8s %-12s %s\n" "$ber" "$(goodput plain "$ber")" "$(goodput fec "$ber")"
+done
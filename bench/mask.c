@@ -0,0 +1,159 @@
+// XOR mask savings over a corpus: every file is cut into I-frame payloads,
+// each framed as build_frame() does it with and without the mask pick_mask()
+// chooses, and the stuffed frame bytes of both are added up.
+//
+// usage: bench/mask [-p PAYLOAD] PATH...
+// build: gcc -Wall -O2 -o bin/bench_mask bench/mask.c src/*.c -Iinclude -lpthread
+// Each PATH gets a line, a directory for all the files below it. PAYLOAD
+// defaults to the 1920 bytes llopen() settles on at 9600 baud. The
+// frames close with a CRC-32C, whose stuffing pick_mask() cannot foresee, so
+// "predicted" is what it expected to save and "saved" what the frames show.
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "stuffing.h"
+
+typedef struct {
+    long bytes;
+    long frames;
+    long masked_frames;
+    long unmasked;   // stuffed frame bytes without a mask
+    long masked;     // and with whatever mask was picked
+    long predicted;
+} Totals;
+
+// Stuffed length of FLAG, header, data, FCS, FLAG
+static long frame_bytes(const unsigned char* header, int header_size, const unsigned char* data, size_t size) {
+
+    uint32_t fcs = fcs_update(FCS_CRC32C, fcs_init(FCS_CRC32C), header, header_size);
+    fcs = fcs_update(FCS_CRC32C, fcs, data, size);
+
+    unsigned char trailer[4];
+    int trailer_size = fcs_trailer_create(FCS_CRC32C, fcs, trailer);
+
+    return 2 + header_size + count_escapes(header, header_size)
+             + size + count_escapes(data, size)
+             + trailer_size + count_escapes(trailer, trailer_size);
+
+}
+
+static int measure(const char* path, size_t payload, Totals* totals) {
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    unsigned char* data = malloc(payload);
+    unsigned char* masked = malloc(payload);
+    size_t size;
+    int seq = 0;
+
+    while ((size = fread(data, 1, payload, file)) > 0) {
+
+        unsigned char header[5];
+        int header_size = info_header_create(header, WRITE_EXT_C, seq, true);
+        long plain = frame_bytes(header, header_size, data, size);
+
+        struct iovec iov = { data, size };
+        size_t saved = 0;
+        unsigned char mask = pick_mask(&iov, 1, header, header_size, WRITE_MASK_C, &saved);
+
+        long sent = plain;
+        if (mask != 0) {
+            xor_mask(masked, data, size, mask);
+            header_size = masked_header_create(header, WRITE_MASK_C, seq, mask);
+            sent = frame_bytes(header, header_size, masked, size);
+            totals->masked_frames++;
+        }
+
+        totals->bytes += size;
+        totals->frames++;
+        totals->unmasked += plain;
+        totals->masked += sent;
+        totals->predicted += saved;
+        seq = (seq + 1) % EXT_MODULUS;
+
+    }
+
+    free(data);
+    free(masked);
+    fclose(file);
+
+    return 0;
+
+}
+
+// what nftw() walks into
+static size_t walk_payload;
+static Totals* walk_totals;
+
+static int measure_entry(const char* path, const struct stat* sb, int type, struct FTW* ftw) {
+
+    (void) ftw;
+    if (type != FTW_F || !S_ISREG(sb->st_mode)) return 0;
+    return measure(path, walk_payload, walk_totals);
+
+}
+
+static void report(const char* name, const Totals* t) {
+
+    long saved = t->unmasked - t->masked;
+    long overhead = t->unmasked - t->bytes;
+
+    printf("%10ld %10ld %10ld %8ld %8ld %6.2f%% %5.1f%% %6ld/%-6ld %s\n", t->bytes, t->unmasked, t->masked,
+           t->predicted, saved, t->unmasked > 0 ? 100.0 * saved / t->unmasked : 0,
+           overhead > 0 ? 100.0 * saved / overhead : 0, t->masked_frames, t->frames, name);
+
+}
+
+int main(int argc, char* argv[]) {
+
+    size_t payload = 1920;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+        payload = atol(argv[2]);
+        first = 3;
+    }
+
+    if (first >= argc || payload == 0) {
+        fprintf(stderr, "usage: %s [-p PAYLOAD] PATH...\n", argv[0]);
+        return 1;
+    }
+
+    // "of ovh" is how much of the framing and stuffing overhead the mask takes off
+    printf("%10s %10s %10s %8s %8s %7s %6s %13s %s\n", "payload", "unmasked", "masked",
+           "predict", "saved", "of wire", "of ovh", "masked frames", "path");
+
+    Totals all = { 0 };
+
+    for (int i = first; i < argc; i++) {
+
+        Totals totals = { 0 };
+        walk_payload = payload;
+        walk_totals = &totals;
+        if (nftw(argv[i], measure_entry, 16, FTW_PHYS) != 0) return 1;
+        report(argv[i], &totals);
+
+        all.bytes += totals.bytes;
+        all.frames += totals.frames;
+        all.masked_frames += totals.masked_frames;
+        all.unmasked += totals.unmasked;
+        all.masked += totals.masked;
+        all.predicted += totals.predicted;
+
+    }
+
+    if (argc - first > 1) report("all", &all);
+
+    return 0;
+
+}
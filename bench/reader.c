@@ -0,0 +1,246 @@
+// Receive path cost: read() calls and CPU time per MB of payload when a
+// stream of I-frames comes in over a pty, read a byte at a time into a
+// per-byte state machine as the link layer used to, or through the buffered
+// FrameReader it uses now.
+//
+// usage: bench/reader [MB]
+// build: gcc -Wall -O2 -o bin/bench_reader bench/reader.c src/*.c -Iinclude -lpthread
+// Frames carry STD_BUFF_SIZE byte packets of random data, 4 MB by default.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <time.h>
+
+#include "utils.h"
+#include "frame_reader.h"
+
+#define PAYLOAD (STD_BUFF_SIZE + PACKET_HEADER_SIZE)
+
+// frames back to back, ends[i] is where frame i stops
+typedef struct {
+    Array bytes;
+    size_t* ends;
+    long frames;
+} Stream;
+
+typedef struct {
+    int fd;
+    const Stream* stream;
+} Writer;
+
+typedef struct {
+    long read_calls;
+    long frames;
+    long payload;
+    double cpu_ms;
+} Result;
+
+static double thread_cpu_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+
+}
+
+// Every frame as llwrite() builds it: FLAG, stuffed header, stuffed payload
+// and BCC2, FLAG
+static void build_stream(Stream* stream, long frames) {
+
+    unsigned char payload[PAYLOAD];
+    init_array(&stream->bytes, frames * PAYLOAD * 2);
+    stream->ends = (size_t *) malloc(frames * sizeof(size_t));
+    stream->frames = frames;
+
+    for (long n = 0; n < frames; n++) {
+
+        unsigned char bcc2 = 0;
+        for (int i = 0; i < PAYLOAD; i++) {
+            payload[i] = rand();
+            bcc2 ^= payload[i];
+        }
+
+        frame_header_create(&stream->bytes, WRITE_C, n % 2, false);
+        for (int i = 0; i < PAYLOAD; i++) insert_stuffed(&stream->bytes, payload[i]);
+        insert_stuffed(&stream->bytes, bcc2);
+        insert_array(&stream->bytes, FLAG);
+        stream->ends[n] = stream->bytes.used;
+
+    }
+
+}
+
+// one write() per frame, as llwrite() sends them
+static void* write_stream(void* arg) {
+
+    Writer* writer = (Writer *) arg;
+    const Stream* stream = writer->stream;
+    size_t done = 0;
+
+    for (long n = 0; n < stream->frames; n++) {
+        while (done < stream->ends[n]) {
+            ssize_t bytes = write(writer->fd, stream->bytes.array + done, stream->ends[n] - done);
+            if (bytes <= 0) return NULL;
+            done += bytes;
+        }
+    }
+
+    return NULL;
+
+}
+
+// The receive loop before the FrameReader, one read() per byte
+static void read_bytewise(int fd, long frames, Result* result) {
+
+    unsigned char frame[2 * PAYLOAD + 8];
+    size_t size = 0;
+    bool in_frame = false;
+    bool escaped = false;
+    unsigned char bcc = 0;
+    unsigned char byte;
+
+    while (result->frames < frames && read(fd, &byte, 1) == 1) {
+
+        result->read_calls++;
+
+        if (byte == FLAG) {
+            // A C BCC1 cancel out, so a good frame XORs to zero
+            if (in_frame && size > 3 && bcc == 0) {
+                result->frames++;
+                result->payload += size - 4;
+            }
+            in_frame = true;
+            escaped = false;
+            size = 0;
+            bcc = 0;
+            continue;
+        }
+
+        if (!in_frame || size == sizeof(frame)) continue;
+
+        if (byte == ESCAPE_FLAG) {
+            escaped = true;
+            continue;
+        }
+
+        if (escaped) {
+            byte = bdestuff(byte);
+            escaped = false;
+        }
+
+        frame[size++] = byte;
+        bcc ^= byte;
+
+    }
+
+}
+
+static void read_buffered(int fd, long frames, Result* result) {
+
+    FrameReader reader;
+    reader_init(&reader, PAYLOAD + FRAME_OVERHEAD);
+
+    Array frame;
+    init_array(&frame, 2 * PAYLOAD);
+
+    while (result->frames < frames) {
+
+        if (!reader_next_frame(&reader, &frame)) {
+            if (reader_fill(&reader, fd) <= 0) break;
+            continue;
+        }
+
+        if (frame.used > 3 && reader.bcc == 0) {
+            result->frames++;
+            result->payload += frame.used - 4;
+        }
+
+    }
+
+    result->read_calls = reader.read_calls;
+
+    free_array(&frame);
+    reader_free(&reader);
+
+}
+
+static int open_pty(int* master) {
+
+    *master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0) return -1;
+
+    int slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+    if (slave < 0) return -1;
+
+    // as llopen() leaves the port: raw, and a read() waits for a byte
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(slave, TCSANOW, &tio);
+
+    return slave;
+
+}
+
+static int run(const Stream* stream, long frames, bool bytewise, Result* result) {
+
+    int master;
+    int slave = open_pty(&master);
+    if (slave < 0) {
+        perror("pty");
+        return -1;
+    }
+
+    *result = (Result) { 0 };
+    Writer writer = { master, stream };
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_stream, &writer);
+
+    double start = thread_cpu_ms();
+    if (bytewise) read_bytewise(slave, frames, result);
+    else read_buffered(slave, frames, result);
+    result->cpu_ms = thread_cpu_ms() - start;
+
+    pthread_join(thread, NULL);
+    close(slave);
+    close(master);
+
+    return 0;
+
+}
+
+static void report(const char* name, const Result* result, long frames) {
+
+    double megabytes = result->payload / 1e6;
+    printf("%-10s %8.0f read() calls/MB  %7.1f ms CPU/MB  %ld of %ld frames\n", name,
+           result->read_calls / megabytes, result->cpu_ms / megabytes, result->frames, frames);
+
+}
+
+int main(int argc, char* argv[]) {
+
+    long megabytes = (argc > 1) ? atol(argv[1]) : 4;
+    long frames = (megabytes * 1000000 + PAYLOAD - 1) / PAYLOAD;
+
+    Stream stream;
+    srand(1);
+    build_stream(&stream, frames);
+
+    Result before, after;
+    if (run(&stream, frames, true, &before) != 0 || run(&stream, frames, false, &after) != 0) return 1;
+
+    report("bytewise", &before, frames);
+    report("buffered", &after, frames);
+
+    free_array(&stream.bytes);
+    free(stream.ends);
+    return (before.frames == frames && after.frames == frames) ? 0 : 1;
+
+}
@@ -0,0 +1,131 @@
+// Reed-Solomon correction limits and codec speed. Every parity count gets
+// codewords with a growing number of bad bytes: up to parity / 2 all of them
+// have to come back intact. Past that rs_decode gives up or, mostly with
+// little parity, lands on another codeword, which the frame's FCS then has
+// to catch.
+//
+// usage: bench/rs [TRIALS]
+// build: gcc -Wall -O2 -o bin/bench_rs bench/rs.c src/*.c -Iinclude -lpthread
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rs.h"
+
+#define SPEED_BYTES (16 * 1024 * 1024)
+
+static double now_s(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+// a random codeword of size bytes, data followed by its parity
+static void random_codeword(unsigned char* codeword, size_t size, int parity) {
+
+    for (size_t i = 0; i < size - parity; i++) codeword[i] = rand();
+    rs_encode(codeword, size - parity, parity, codeword + size - parity);
+
+}
+
+// changes errors distinct bytes, each to a different value
+static void damage(unsigned char* codeword, size_t size, int errors) {
+
+    bool hit[RS_BLOCK] = { false };
+
+    for (int e = 0; e < errors; e++) {
+        size_t pos;
+        do pos = rand() % size; while (hit[pos]);
+        hit[pos] = true;
+        codeword[pos] ^= 1 + rand() % 255;
+    }
+
+}
+
+static void limits(int parity, size_t size, int trials) {
+
+    unsigned char sent[RS_BLOCK], received[RS_BLOCK];
+
+    printf("RS(%zu,%zu), corrects %d\n", size, size - parity, parity / 2);
+    printf("  errors   corrected  gave up  wrong data\n");
+
+    for (int errors = 0; errors <= parity / 2 + 3; errors++) {
+
+        int corrected = 0, gave_up = 0, wrong = 0;
+
+        for (int t = 0; t < trials; t++) {
+            random_codeword(sent, size, parity);
+            memcpy(received, sent, size);
+            damage(received, size, errors);
+
+            int fixed = rs_decode(received, size, parity);
+            if (fixed < 0) gave_up++;
+            else if (fixed == errors && memcmp(received, sent, size) == 0) corrected++;
+            else wrong++;
+        }
+
+        printf("  %6d %11d %8d %11d%s\n", errors, corrected, gave_up, wrong,
+               (errors <= parity / 2 && corrected != trials) ? "  FAIL" : "");
+
+    }
+
+    printf("\n");
+
+}
+
+// MB/s of codeword through rs_encode and through rs_decode with errors bad bytes
+static void speed(int parity, int errors) {
+
+    size_t size = RS_BLOCK;
+    int count = SPEED_BYTES / size;
+    unsigned char* codewords = malloc((size_t) count * size);
+
+    for (size_t i = 0; i < (size_t) count * size; i++) codewords[i] = rand();
+
+    double start = now_s();
+    for (int i = 0; i < count; i++) {
+        unsigned char* codeword = codewords + i * size;
+        rs_encode(codeword, size - parity, parity, codeword + size - parity);
+    }
+    double encode = count * size / (now_s() - start) / 1e6;
+
+    for (int i = 0; i < count; i++) damage(codewords + i * size, size, errors);
+
+    start = now_s();
+    for (int i = 0; i < count; i++) rs_decode(codewords + i * size, size, parity);
+    double decode = count * size / (now_s() - start) / 1e6;
+
+    printf("RS(255,%d) encode %6.1f MB/s, decode with %2d bad bytes %6.1f MB/s\n",
+           255 - parity, encode, errors, decode);
+
+    free(codewords);
+
+}
+
+int main(int argc, char* argv[]) {
+
+    int trials = (argc > 1) ? atoi(argv[1]) : 1000;
+    int parities[] = { 4, 8, 16, 32 };
+
+    srand(1);
+
+    for (int i = 0; i < 4; i++) {
+        limits(parities[i], RS_BLOCK, trials);
+    }
+
+    // frames end on a shortened codeword
+    limits(16, 64, trials);
+
+    for (int i = 0; i < 4; i++) {
+        speed(parities[i], 0);
+        speed(parities[i], parities[i] / 2);
+    }
+
+    return 0;
+
+}
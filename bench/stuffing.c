@@ -0,0 +1,118 @@
+// Byte stuffing throughput: the per-byte insert_stuffed loop bstuff used to
+// run against the counting kernel it runs now, over 400 byte payloads.
+//
+// usage: bench/stuffing [FILE]
+// build: gcc -Wall -O2 -o bin/bench_stuffing bench/stuffing.c src/*.c -Iinclude -lpthread
+// FILE stands in for typical file data, the benchmark binary by default.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "stuffing.h"
+
+#define PAYLOAD 400
+#define TOTAL (32 * 1024 * 1024)
+#define ROUNDS 3
+
+static double now_s(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+// bstuff before the kernel, one insert_array call per output byte
+static void bstuff_bytewise(Array* a, Array* b) {
+
+    for (size_t i = 0; i < a->used; i++) {
+        insert_stuffed(b, a->array[i]);
+    }
+
+    free_array(a);
+
+}
+
+// MB/s of payload stuffed, each payload copied into a fresh Array as llwrite does
+static double run_once(const unsigned char* data, size_t size, bool bytewise) {
+
+    size_t done = 0;
+    double start = now_s();
+
+    while (done < TOTAL) {
+        for (size_t off = 0; off + PAYLOAD <= size && done < TOTAL; off += PAYLOAD) {
+
+            Array payload, out;
+            init_array(&payload, PAYLOAD);
+            memcpy(payload.array, data + off, PAYLOAD);
+            payload.used = PAYLOAD;
+            init_array(&out, 16);
+
+            if (bytewise) bstuff_bytewise(&payload, &out);
+            else bstuff(&payload, &out, FCS_XOR, NULL);
+
+            free_array(&out);
+            done += PAYLOAD;
+
+        }
+    }
+
+    return done / (now_s() - start) / 1e6;
+
+}
+
+// the best of a few rounds, the first one pays for cold caches and page faults
+static double run(const unsigned char* data, size_t size, bool bytewise) {
+
+    double best = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        double rate = run_once(data, size, bytewise);
+        if (rate > best) best = rate;
+    }
+
+    return best;
+
+}
+
+static void report(const char* name, const unsigned char* data, size_t size) {
+
+    double old = run(data, size, true);
+    double new = run(data, size, false);
+    printf("%-14s %5zu escapes/KB  %8.0f -> %8.0f MB/s  (x%.1f)\n", name,
+           count_escapes(data, size) * 1024 / size, old, new, new / old);
+
+}
+
+int main(int argc, char* argv[]) {
+
+    const char* path = (argc > 1) ? argv[1] : "/proc/self/exe";
+    size_t size = 1024 * 1024;
+    unsigned char* data = malloc(size);
+
+    srand(1);
+    for (size_t i = 0; i < size; i++) data[i] = rand();
+    report("random data", data, size);
+
+    memset(data, FLAG, size);
+    report("all 0x7E", data, size);
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    size = fread(data, 1, size, file);
+    fclose(file);
+    if (size < PAYLOAD) {
+        fprintf(stderr, "%s: shorter than one payload\n", path);
+        return 1;
+    }
+    report(path, data, size);
+
+    free(data);
+    return 0;
+
+}
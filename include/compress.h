@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Compression of the file data, announced in the START packet. Blocks that
+// do not get smaller go out as plain data packets, so a compressed transfer
+// is never longer on the wire than an uncompressed one.
+typedef enum
+{
+    COMPRESS_NONE,
+    COMPRESS_LZ   // LZ77 with LZ4 style sequences
+} CompressMode;
+
+// What the transmitter compresses with, -DCOMPRESSION=COMPRESS_NONE sends
+// file data as it is
+#ifndef COMPRESSION
+#define COMPRESSION COMPRESS_LZ
+#endif
+
+// Newest mode this build expands, offered to the peer on llopen(). A
+// transmitter only compresses with a mode the receiver offered.
+#define COMPRESS_NEWEST COMPRESS_LZ
+
+// Matches reach back this far, across block boundaries. Both ends keep at
+// least this much of the file behind the block being worked on.
+#define LZ_WINDOW 65536
+#define LZ_MAX_OFFSET (LZ_WINDOW - 1)
+
+// Most file bytes one compressed block may expand to
+#define LZ_MAX_BLOCK 65536
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+// Positions in the encoder table are offsets into the caller's buffer plus
+// one, zero marks an empty slot
+typedef struct {
+    uint32_t table[1 << LZ_HASH_BITS];
+} LzEncoder;
+
+void lz_init(LzEncoder* e);
+void lz_shift(LzEncoder* e, size_t shift);
+size_t lz_compress(LzEncoder* e, const unsigned char* base, size_t pos, size_t end, unsigned char* out, size_t capacity, size_t* consumed);
+long lz_decompress(const unsigned char* in, size_t size, unsigned char* base, size_t pos, size_t capacity);
+const char* compress_name(CompressMode mode);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Frame check sequence of extended information frames. Legacy frames, XID
+// and anything sent before negotiation keep the one byte XOR BCC2.
+typedef enum
+{
+    FCS_XOR,
+    FCS_CRC16,  // CRC-16-CCITT as in HDLC/X.25
+    FCS_CRC32,  // CRC-32 as in HDLC/Ethernet
+    FCS_CRC32C  // Castagnoli, uses the SSE4.2 crc32 instruction when present
+} FcsMode;
+
+#ifndef FCS_MODE
+#define FCS_MODE FCS_CRC32C
+#endif
+
+int fcs_size(FcsMode mode);
+uint32_t fcs_init(FcsMode mode);
+uint32_t fcs_update(FcsMode mode, uint32_t fcs, const unsigned char* buf, size_t size);
+int fcs_trailer_create(FcsMode mode, uint32_t fcs, unsigned char trailer[4]);
+bool fcs_check(FcsMode mode, uint32_t fcs);
+const char* fcs_name(FcsMode mode);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "utils.h"
+
+// Fixed-size buffers carved out of one block, sized once per session from the
+// negotiated frame size. Frames take a buffer while they are in flight or
+// waiting to be delivered and give it back afterwards, so the data path never
+// calls malloc() or free().
+typedef struct {
+    unsigned char* memory;
+    unsigned char** free;   // stack of buffers not in use
+    int count;
+    int available;
+    size_t buffer_size;
+} FramePool;
+
+void pool_init(FramePool* p, int count, size_t buffer_size);
+void pool_free(FramePool* p);
+bool pool_take(FramePool* p, Array* a);
+void pool_give(FramePool* p, Array* a);
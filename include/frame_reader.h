@@ -0,0 +1,34 @@
+#pragma once
+
+#include "utils.h"
+
+// Free space every read() gets at least
+#define READER_MIN_READ 4096
+
+// Buffered input for the link layer. Every read() pulls in as much as the
+// driver has ready and the scanner cuts whole frames out of it, so bytes that
+// belong to the next frame stay buffered for the following call. A frame that
+// is still arriving waits in place until its closing flag shows up, the buffer
+// is sized so the longest stuffed frame always fits in one contiguous run.
+typedef struct {
+    unsigned char* buf;
+    size_t capacity;
+    size_t head;    // next byte to scan
+    size_t tail;    // next free byte
+    size_t scanned; // bytes after head already known to hold no flag
+    size_t max_frame;  // longest destuffed frame accepted
+    int state;      // FRAME_STATES of the frame being assembled
+    unsigned char bcc; // XOR over every destuffed byte of the last frame
+    FcsMode fcs;       // CRC that also runs over each frame, if any
+    uint32_t crc;
+
+    long read_calls;
+    long bytes_read;
+} FrameReader;
+
+void reader_init(FrameReader* r, size_t max_frame);
+void reader_resize(FrameReader* r, size_t max_frame);
+void reader_free(FrameReader* r);
+int reader_fill(FrameReader* r, int fd);
+bool reader_pending(FrameReader* r);
+bool reader_next_frame(FrameReader* r, Array* frame);
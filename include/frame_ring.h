@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "utils.h"
+
+// slots in a ring, a power of two so the counters may wrap
+#define RING_SLOTS 32
+
+typedef struct {
+    Array buffer;   // used == 0 marks the end of the stream
+    int payload;    // packet bytes a frame carries
+    int fec;        // FEC level it was coded with
+} RingSlot;
+
+// Bounded queue of buffers between exactly one producer thread and one
+// consumer thread. Each side only ever writes its own counter, so neither
+// locks; a side that finds the ring full or empty sleeps on the other's
+// counter until it moves.
+typedef struct {
+    RingSlot slots[RING_SLOTS];
+    uint32_t head;      // slots released by the consumer
+    uint32_t tail;      // slots published by the producer
+    uint32_t producer_waiting;
+    uint32_t consumer_waiting;
+} FrameRing;
+
+void ring_init(FrameRing* r, size_t buffer_size);
+void ring_free(FrameRing* r);
+
+RingSlot* ring_slot_to_fill(FrameRing* r);
+void ring_publish(FrameRing* r);
+RingSlot* ring_slot_to_take(FrameRing* r);
+void ring_release(FrameRing* r);
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <time.h>
+
+#include "link_layer.h"
+#include "utils.h"
+#include "frame_reader.h"
+#include "frame_pool.h"
+
+// packets link_submit_send() takes ahead of the window, and receives that may be posted
+#define LINK_QUEUE 32
+
+// every request outstanding ends as one completion
+#define LINK_COMPLETIONS (EXT_MODULUS + 2 * LINK_QUEUE)
+
+// The quality monitor looks at the last QUALITY_WINDOW outcomes, a frame
+// acknowledged or a reject or timeout against one. QUALITY_BAD rejects and
+// timeouts among them ask for more protection, QUALITY_CLEAN frames in a
+// row without either for less.
+#define QUALITY_WINDOW 64  // bits of LinkContext.quality
+#define QUALITY_BAD 4
+#define QUALITY_CLEAN 512
+
+// FEC level the monitor starts from, later steps double it
+#define QUALITY_FEC_STEP 8
+
+// mode changes llclose() lists one by one
+#define MODE_LOG 16
+
+typedef struct {
+    int packet;      // packets sent or read when it happened
+    int blamed;      // rejects and timeouts among the last QUALITY_WINDOW outcomes, -1 when the peer asked
+    double srtt;
+    int payload;
+    int fec;
+} ModeChange;
+
+typedef enum {
+    LINK_SENT,      // the peer acknowledged the packet
+    LINK_RECEIVED,  // a packet was copied into the buffer
+    LINK_FAILED     // the packet could not be framed or written, size is -1
+} LinkEvent;
+
+// What link_poll() hands back for each finished request
+typedef struct {
+    LinkEvent event;
+    void* user;     // as given on submission
+    int size;       // packet bytes sent or received
+} LinkCompletion;
+
+typedef struct {
+    Array packet;
+    void* user;
+    bool notify;    // ends in a completion, llwrite() queues packets that do not
+} LinkRequest;
+
+// Everything one serial link keeps between calls. Links share nothing, so
+// a process can drive any number of them, each from its own thread, without
+// locking. llopen()/llwrite()/llread()/llclose() run on a default link.
+typedef struct {
+    int packets_sent;
+    int packets_read;
+
+    int current_fd;
+    int epoll_fd;      // the port and timer_fd, every wait of the link is on it
+    int timer_fd;      // deadline of the current wait
+    uint32_t port_events;
+    int current_baudrate;
+    int current_retries;
+    int current_timeout;
+    LinkLayerRole current_role;
+
+    // negotiated on link_open(), stop-and-wait until the peer proves otherwise
+    LinkParams link_params;
+
+    // send queue, indexed by N(S)
+    Array tx_window[EXT_MODULUS];
+    int tx_base;     // oldest unacknowledged N(S)
+    int tx_next;     // N(S) of the next new frame
+    int tx_tries;
+    double tx_deadline[EXT_MODULUS]; // retransmission timer of each frame, in ms
+    double tx_sent_at[EXT_MODULUS];
+    double tx_queued[EXT_MODULUS];   // time the output queue needed to drain ahead of it
+    bool tx_resent[EXT_MODULUS];     // Karn's rule, retransmitted frames give no RTT sample
+    bool tx_timed_out[EXT_MODULUS];  // its timer ran out, which is held against the line only once it turns out damaged
+    int rx_expected; // N(S) the receiver is waiting on
+    bool reject_sent;
+    int acks_pending;    // frames delivered in order since the last RR or REJ
+    double ack_deadline; // when the oldest of them has to be acknowledged
+    long acks_sent;
+
+    // selective repeat reorder buffer, frames in [rx_deliver, rx_expected) were
+    // acknowledged but not handed to the application yet
+    Array rx_window[EXT_MODULUS];
+    bool rx_stored[EXT_MODULUS];
+    bool rx_aggregated[EXT_MODULUS];
+    bool srej_sent[EXT_MODULUS];
+    int rx_deliver;
+
+    // packets of the aggregated frame being handed out, each behind its length
+    Array rx_batch;
+    size_t rx_batch_pos;
+    long aggregated_frames;
+    long aggregated_packets;
+
+    int retransmissions;
+    long frame_writes;
+
+    // I-frames framed XOR masked and the stuffed bytes that took off them,
+    // counted by whichever thread built them
+    long masked_frames;
+    long mask_saved;
+    int rejects_received;
+    int selective_rejects_received;
+
+    // Reed-Solomon repairs of received frames
+    long fec_corrected;   // bytes
+    long fec_frames;
+    long fec_failures;
+    bool rx_repaired;     // since the last RR, which tells the peer
+
+    // quality monitor, moves the FEC level in link_params and the payload asked
+    // of the application while the link runs; buffers are sized for the most
+    // either may reach
+    int payload;          // packet size link_payload() suggests, up to max_payload
+    int fec_limit;
+    uint64_t quality;     // one bit per outcome, newest lowest, set for a reject or a damaged frame that timed out
+    int clean_run;        // frames acknowledged since the last of those or a frame the peer repaired
+    int mode_fec;         // what the monitor wants, applied before anything else is sent
+    int mode_payload;
+    int mode_blamed;      // rejects and timeouts the monitor saw when it picked them
+    int mode_changes;
+    ModeChange mode_log[MODE_LOG];
+    Array recode;         // frames built ahead for another FEC level are unpacked here
+
+    // RTT estimator, all in ms, starts at the link_open() timeout until a sample arrives
+    double srtt;
+    double rttvar;
+    double rto;
+    double rto_min_seen;
+    double rto_max_seen;
+    int rtt_samples;
+    int timeouts;
+
+    FrameReader reader;
+    Array rx_frame;
+
+    // buffers of the frames in tx_window and rx_window
+    FramePool tx_pool;
+    FramePool rx_pool;
+    long setup_allocations;
+
+    long payload_bytes;
+    clock_t cpu_start;
+
+    // asynchronous requests: packets waiting for the window in send_pool
+    // buffers, buffers posted for packets still to come, and what finished
+    // since the last link_poll()
+    LinkRequest send_queue[LINK_QUEUE];
+    int send_head;
+    int send_count;
+    FramePool send_pool;
+    LinkRequest recv_queue[LINK_QUEUE];
+    int recv_head;
+    int recv_count;
+    int tx_notify[EXT_MODULUS];        // submitted packets each frame carries
+    LinkCompletion sent[LINK_COMPLETIONS]; // theirs, in the order they were framed
+    int sent_head;
+    int sent_count;
+    int async_sends;    // submitted and not acknowledged yet
+    LinkCompletion done[LINK_COMPLETIONS];
+    int done_head;
+    int done_count;
+} LinkContext;
+
+// Same contracts as their ll counterparts, on the link given. link_open()
+// returns NULL on failure, link_close() frees the link whatever happens.
+LinkContext* link_open(LinkLayer connectionParameters);
+int link_write(LinkContext* ll, const unsigned char* buf, int bufSize);
+int link_writev(LinkContext* ll, const struct iovec* iov, int iovcnt);
+int link_read(LinkContext* ll, unsigned char* packet);
+int link_close(LinkContext* ll, int showStatistics);
+int link_maxpayload(LinkContext* ll);
+
+// Packet size the quality monitor asks for right now, never above
+// link_maxpayload(). Safe to call from any thread.
+int link_payload(LinkContext* ll);
+
+// Framing split off sending, so frames can be built ahead on another thread.
+// The frame for the k-th packet from now carries N(S) link_next_seq() + k,
+// modulo link_modulus(). Frames are coded for the link_fec() level read
+// before building them, and rebuilt on sending if it moved in between.
+int link_frame(LinkContext* ll, int seq, int fec, const struct iovec* iov, int iovcnt, unsigned char* out);
+size_t link_frame_size(LinkContext* ll);
+int link_send_frame(LinkContext* ll, const unsigned char* frame, int size, int payload, int fec);
+int link_fec(LinkContext* ll);
+int link_next_seq(LinkContext* ll);
+
+// Newest compression the peer said on llopen() it expands
+CompressMode link_compression(LinkContext* ll);
+int link_modulus(LinkContext* ll);
+
+// Requests that return at once, link_poll() runs the link and reports what
+// finished. They mix with the blocking calls, which first send whatever
+// was submitted before them.
+int link_submit_send(LinkContext* ll, const struct iovec* iov, int iovcnt, void* user);
+int link_submit_receive(LinkContext* ll, unsigned char* buf, void* user);
+int link_poll(LinkContext* ll, LinkCompletion* completions, int max, int timeout_ms);
+
+// link the ll*() calls run on
+extern LinkContext* default_link;
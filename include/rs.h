@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+
+// Reed-Solomon over GF(256), x^8 + x^4 + x^3 + x^2 + 1, with the generator's
+// roots at alpha^0 .. alpha^(parity - 1). Codewords are shortened, data of
+// any length up to RS_BLOCK - parity is followed by its parity bytes.
+#define RS_BLOCK 255
+#define RS_MAX_PARITY 32
+
+void rs_encode(const unsigned char* data, size_t size, int parity, unsigned char* out);
+int rs_decode(unsigned char* codeword, size_t size, int parity);
+
+size_t rs_coded_size(size_t size, int parity);
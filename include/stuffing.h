@@ -0,0 +1,19 @@
+#pragma once
+
+#include "utils.h"
+#include "crc.h"
+
+// Stuffing and the FCS advance together in chunks of this many bytes
+#define FCS_CHUNK 1024
+
+// Byte stuffing kernels. FLAG/ESCAPE_FLAG lookups use AVX2 or SSE2 when the
+// CPU has them and a plain loop otherwise.
+
+size_t count_escapes(const unsigned char* buf, size_t size);
+size_t stuff_raw(unsigned char* out, const unsigned char* in, size_t size);
+size_t stuff_span(unsigned char* out, const unsigned char* in, size_t size, FcsMode mode, uint32_t* fcs);
+int destuff_span(unsigned char* out, const unsigned char* in, size_t size, unsigned char* bcc, FcsMode mode, uint32_t* fcs);
+
+// XOR masks that move data away from FLAG and ESCAPE_FLAG before stuffing
+unsigned char pick_mask(const struct iovec* iov, int iovcnt, const unsigned char* header, int header_size, unsigned char masked_C, size_t* saved);
+void xor_mask(unsigned char* out, const unsigned char* in, size_t size, unsigned char mask);
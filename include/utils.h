@@ -5,6 +5,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+
+#include "crc.h"
+#include "compress.h"
+#include "rs.h"
 
 #define STD_BUFF_SIZE 400
 
@@ -26,20 +31,181 @@
 #define UA_C 0x07
 #define RR_C 0x05
 #define REJ_C 0x01
+#define SREJ_C 0x0D
+#define XID_C 0xAF
+#define MODE_C 0x2F
+#define WRITE_EXT_C 0x02
+#define WRITE_AGG_C 0x06
+#define WRITE_MASK_C 0x0A
+#define WRITE_MASK_AGG_C 0x0E
+
+// Top bit of an extended RR's N(R) byte, set when FEC had to repair a frame
+// since the last RR. Only peers that take MODE frames are sent it.
+#define NR_REPAIRED 0x80
+
+// ARQ
+// Extended frames carry a full sequence number byte after C, so windows
+// larger than one frame are possible. Legacy frames keep the 1-bit N(S)/N(R).
+#define LEGACY_MODULUS 2
+#define EXT_MODULUS 128
+#define MAX_WINDOW (EXT_MODULUS - 1)
+// selective repeat must never confuse a new frame with an old one
+#define MAX_SR_WINDOW (EXT_MODULUS / 2)
+
+#define SUPERVISORY_MAX 8
+
+// Payload sizes
+// Legacy peers size their buffers for one STD_BUFF_SIZE data packet, larger
+// frames are only sent once XID agreed on them. The data packet length field
+// is 16 bits wide, which caps everything else.
+#define PACKET_HEADER_SIZE 4
+// striped data packets also carry their 8 byte file offset
+#define STRIPE_HEADER_SIZE (PACKET_HEADER_SIZE + 8)
+#define LEGACY_MAX_PAYLOAD (STD_BUFF_SIZE + PACKET_HEADER_SIZE)
+#define MAX_FRAME_PAYLOAD (65535 + PACKET_HEADER_SIZE)
+// A C N M BCC1 and the widest FCS
+#define FRAME_OVERHEAD 9
+
+typedef enum
+{
+    ARQ_STOP_AND_WAIT,
+    ARQ_GO_BACK_N,
+    ARQ_SELECTIVE_REPEAT
+} ArqMode;
+
+// Proposed on llopen(), the peer may only lower them
+#ifndef ARQ_MODE
+#define ARQ_MODE ARQ_SELECTIVE_REPEAT
+#endif
+
+#ifndef ARQ_WINDOW
+#define ARQ_WINDOW 7
+#endif
+
+// Floor of the retransmission timeout, the llopen() timeout is its ceiling
+#ifndef RTO_MIN_MS
+#define RTO_MIN_MS 20
+#endif
+
+// The receiver acknowledges every ACK_EVERY frames delivered in order with
+// one cumulative RR, or sooner once the oldest of them waited ACK_DELAY_MS.
+// Never more than half a window, and rejects still go out at once.
+// -DACK_EVERY=1 acknowledges every frame.
+#ifndef ACK_EVERY
+#define ACK_EVERY 4
+#endif
+
+#ifndef ACK_DELAY_MS
+#define ACK_DELAY_MS 10
+#endif
+
+// capped on llopen() so one frame still goes out well within a timeout
+#ifndef FRAME_PAYLOAD
+#define FRAME_PAYLOAD 4096
+#endif
+
+// -DPAYLOAD_CAP=0 leaves FRAME_PAYLOAD uncapped, for lines that run faster
+// than their nominal baud rate, as pty pairs and USB adapters do
+#ifndef PAYLOAD_CAP
+#define PAYLOAD_CAP 1
+#endif
+
+// Reed-Solomon parity proposed per codeword of an I-frame, lets the receiver
+// repair up to half as many bad bytes in every RS_BLOCK instead of asking for
+// the frame again. Costs line time on clean lines, so it is off unless built
+// with e.g. -DFEC_PARITY=16. Anything under FEC_MIN_PARITY turns it off.
+#ifndef FEC_PARITY
+#define FEC_PARITY 0
+#endif
+
+// supervisory frames stay shorter than any coded frame
+#define FEC_MIN_PARITY 4
+
+// The sending end watches how many frames it has to repeat and moves between
+// frame sizes and FEC levels while the link runs, with MODE frames. Both
+// ends have to offer it on llopen(), -DLINK_ADAPT=0 keeps them fixed.
+#ifndef LINK_ADAPT
+#define LINK_ADAPT 1
+#endif
+
+// Packets waiting for the window share one I-frame, each behind its 2 byte
+// length, while they fit. Both ends have to offer it on llopen().
+#ifndef AGGREGATE
+#define AGGREGATE 1
+#endif
+
+#define SUBPACKET_HEADER_SIZE 2
+#define MAX_SUBPACKET 0xFFFF
+
+// I-frame data is XORed with whichever byte leaves the fewest FLAG and
+// ESCAPE_FLAG bytes to stuff, when that pays for the mask byte the header
+// then carries. Both ends have to offer it on llopen().
+#ifndef XOR_MASK
+#define XOR_MASK 1
+#endif
+
+// Files at least this large offer to pick up where an earlier transfer
+// stopped, the receiver answers START with what its checkpoint holds. A
+// receiver that predates it never answers, -DRESUME=0 sends to those.
+#ifndef RESUME
+#define RESUME 1
+#endif
+
+#ifndef RESUME_MIN_SIZE
+#define RESUME_MIN_SIZE (1 << 20)
+#endif
+
+// Reading the file, framing and the serial port each get a thread on the
+// sending side. Built with -DTX_PIPELINE=0 one thread does all of it,
+// queueing packets on the link asynchronously.
+#ifndef TX_PIPELINE
+#define TX_PIPELINE 1
+#endif
+
+// Most serial ports one transfer can be spread over
+#define MAX_STRIPES 8
+
+// the receiver's checkpoint moves on after this many bytes reached the disk
+#ifndef CHECKPOINT_BYTES
+#define CHECKPOINT_BYTES (256 * 1024)
+#endif
 
 typedef enum
 {
     DATA_PACKET_C = 1,
     START_PACKET_C = 2,
-    END_PACKET_C = 3
+    END_PACKET_C = 3,
+    COMPRESSED_PACKET_C = 4, // same header as a data packet, the body is one LZ block
+    SESSION_END_PACKET_C = 5, // C alone, after the last file of a batch
+    RESUME_PACKET_C = 6,     // receiver's offer after START, then the transmitter's answer
+    STRIPE_PACKET_C = 7      // data packet header followed by the 8 byte file offset
 } PacketC;
 
 typedef enum
 {
     SIZE_PACKET_T,
-    FILENAME_PACKET_T
+    FILENAME_PACKET_T,
+    COMPRESSION_PACKET_T,   // mode, then the block size as 4 bytes
+    BATCH_PACKET_T,         // no value, more files follow on this link
+    RESUME_PACKET_T,        // no value, the transmitter waits for a RESUME packet
+    OFFSET_PACKET_T,        // 8 bytes, where the data picks up
+    CHECKSUM_PACKET_T,      // 4 bytes, CRC-32 of the file before the offset
+    STRIPE_PACKET_T         // 1 byte, number of links the file is spread over
 } PacketT;
 
+typedef enum
+{
+    XID_ARQ_T = 1,
+    XID_WINDOW_T,
+    XID_FCS_T,
+    XID_PAYLOAD_T,
+    XID_FEC_T,      // Reed-Solomon parity bytes per codeword, 0 for none
+    XID_ADAPT_T,    // 1 byte, the peer takes MODE frames
+    XID_AGGREGATE_T, // 1 byte, the peer splits aggregated I-frames
+    XID_MASK_T,      // 1 byte, the peer unmasks masked I-frames
+    XID_COMPRESS_T   // 1 byte, newest CompressMode the peer expands
+} XidT;
+
 typedef struct {
     unsigned char* array;
     size_t used;
@@ -51,6 +217,39 @@ typedef union {
     long filesize;
 } Filesize;
 
+typedef struct {
+    CompressMode mode;
+    int block_size; // most file bytes a compressed packet expands to
+} Compression;
+
+typedef struct {
+    ArqMode arq;
+    int window;
+    int modulus;
+    FcsMode fcs;
+    int max_payload;
+    int fec;        // parity bytes per codeword of every I-frame, 0 without FEC
+    bool adaptive;  // MODE frames may change fec and the payload asked for
+    bool aggregate; // I-frames may carry several packets
+    bool mask;      // I-frame data may be XOR masked
+    CompressMode compress; // file data may go out compressed up to this mode
+} LinkParams;
+
+typedef struct {
+    unsigned char control; // C field without the sequence bits
+    int seq;               // N(S) on information frames, N(R) on responses
+    unsigned char* data;
+    int size;
+    bool valid_data;       // BCC2 matched
+    bool extended;         // carried a full sequence byte
+    bool aggregated;       // data is length-prefixed packets
+    unsigned char mask;    // XORed over data on the wire, 0 when unmasked
+    bool repaired;         // an RR after frames FEC had to repair
+} Frame;
+
+extern long allocations;
+
+void* track_realloc(void* ptr, size_t size);
 void init_array(Array* a, size_t init_size);
 void insert_array(Array* a, char element);
 void insert_long(Array* a, long element);
@@ -61,31 +260,44 @@ void free_array(Array* a);
 void sender_block_create(unsigned char block[5]);
 void receiver_block_create(unsigned char block[5]);
 void command_block_create(unsigned char block[5], unsigned char command);
-void response_block_create(unsigned char block[5], unsigned char response, bool packet_switch);
+int response_block_create(unsigned char block[SUPERVISORY_MAX], unsigned char response, int nr, const LinkParams* params);
 
-void start_packet_create(Array* a, const char* filename, long file_size);
+void start_packet_create(Array* a, const char* filename, long file_size, const Compression* compression, bool batch, bool resume, int stripes);
 void end_packet_create(Array* a, const char* filename, long file_size);
-void data_packet_create(Array* a, int order, int buff_size, unsigned char buffer[]);
+void data_packet_header(unsigned char header[PACKET_HEADER_SIZE], int order, int buff_size);
+void stripe_packet_header(unsigned char header[STRIPE_HEADER_SIZE], int order, int buff_size, long offset);
 
-int parse_start_packet(Array* a, Array* rcv_filename, Filesize* rcv_filesize);
+int parse_start_packet(Array* a, Array* rcv_filename, Filesize* rcv_filesize, Compression* rcv_compression, bool* rcv_batch, bool* rcv_resume, int* rcv_stripes);
+void resume_packet_create(Array* a, long offset, uint32_t checksum);
+int parse_resume_packet(unsigned char* packet, int size, long* offset, uint32_t* checksum);
+int file_checksum(int fd, long size, uint32_t* checksum);
 void create_filename(Array* s, Array* rcv_filename);
-void get_buffer(Array* a, Array* buffer, int size);
-
-void set_state_machine(unsigned char super_frame);
-void ua_state_machine(unsigned char super_frame);
-int llwrite_state_machine(unsigned char super_frame);
-void llread_state_machine(unsigned char info_frame, Array* buffer);
-void llclosetx_state_machine(unsigned char super_frame);
-void llcloserx_state_machine(unsigned char super_frame);
+int batch_filename(Array* s, const char* dir, Array* rcv_filename);
+int make_parents(char* path);
 
 long get_file_size(FILE* file_stream);
 
+// largest buffer llwrite() takes and llread() hands back, negotiated on llopen()
+int llmaxpayload();
+int llwritev(const struct iovec* iov, int iovcnt);
+
 // link layer functions
 
-void bstuff(Array* a, Array* b);
+void insert_stuffed(Array* a, unsigned char element);
+void bstuff(Array* a, Array* b, FcsMode mode, uint32_t* fcs);
 unsigned char bdestuff(unsigned char a);
 
-void packet_state_machine(unsigned char info_frame);
+void frame_header_create(Array* buf, unsigned char C, int seq, bool extended);
+int info_header_create(unsigned char header[4], unsigned char C, int seq, bool extended);
+int masked_header_create(unsigned char header[5], unsigned char C, int seq, unsigned char mask);
+int parse_frame(Array* frame, unsigned char bcc, uint32_t fcs, FcsMode mode, Frame* out);
+
+void xid_frame_create(Array* a, const LinkParams* params);
+void parse_xid(Frame* frame, LinkParams* params);
+void negotiate_params(LinkParams* own, const LinkParams* peer);
+void mode_frame_create(Array* a, int fec, int payload);
+int parse_mode(Frame* frame, int* fec, int* payload);
+const char* arq_name(ArqMode arq);
+const char* fec_name(int fec);
 
-void attach_info_frame(Array* buf, bool packet_switch);
-void frame_header_create(Array* buf, bool packet_switch);
\ No newline at end of file
+double now_ms();
@@ -1,8 +1,1104 @@
 // Application layer maotocol implementation
 
+#define _GNU_SOURCE
+
 #include "application_layer.h"
 #include "link_layer.h"
+#include "link_context.h"
+#include "frame_ring.h"
 #include "utils.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+
+// file bytes taken in and packet bytes sent for them, and how many packets went out compressed
+long data_bytes = 0;
+long packet_bytes = 0;
+int compressed_packets = 0;
+int data_packets = 0;
+
+// COMPRESSION if the receiver said on llopen() it expands it, else none
+CompressMode compression_mode = COMPRESS_NONE;
+
+// per file figures of a session, printed once the link is closed
+typedef struct {
+    char name[256];
+    long bytes;
+    double ms;
+} FileStats;
+
+FileStats* file_stats = NULL;
+int files_done = 0;
+int files_capacity = 0;
+
+// where the relative names of a batch start in the paths nftw() hands over
+size_t batch_root = 0;
+
+// receiver's record of how much of a resumable file is safely on disk
+typedef struct {
+    int fd;        // the checkpoint itself, -1 while there is none
+    int file;      // the file it describes
+    long size;     // announced size
+    long offset;   // bytes written so far
+    long saved;    // offset the checkpoint holds
+    char name[256];
+    char path[PATH_MAX];
+} Checkpoint;
+
+Checkpoint checkpoint = { .fd = -1 };
+
+// What the threads of a striped transfer share, one per serial port
+typedef struct {
+    long next;                  // first file byte no link has claimed yet
+    long size;                  // file size the receiving links were told
+    long bytes[MAX_STRIPES];    // file bytes each link carried
+    double ms[MAX_STRIPES];     // how long each one took
+} Stripes;
+
+Stripes stripes;
+
+// One port of a striped transfer, run on a link of its own
+typedef struct {
+    LinkLayer link_info;
+    int index;
+    int count;
+    const char* filename;
+    const unsigned char* map;
+    long file_size;
+    int result;     // 0 once the link carried its share and closed
+} StripeLink;
+
+// What the reader stage needs to turn the rest of a file into DATA packets
+typedef struct {
+    FILE* file;
+    long file_size;
+    long offset;
+    LzEncoder* lz;
+    unsigned char* scratch;
+    int chunk_size;
+    FrameRing* packets;   // hands the packets to the framer, NULL sends them right away
+    int failed;           // set by whichever stage fails, the reader stops at it
+} DataSource;
+
+// The framer stage, builds frames for the N(S) the link will give them
+typedef struct {
+    FrameRing* packets;
+    FrameRing* frames;
+    int seq;
+    int* failed;
+} Framer;
+
+// Queues a packet on the link and gets on with the file while it goes out,
+// collecting acknowledgements whenever the link has no room for more
+static int submit_packet(const struct iovec* packet, int count)
+{
+    LinkCompletion done[LINK_QUEUE];
+    int submitted;
+
+    while ((submitted = link_submit_send(default_link, packet, count, NULL)) == 0) {
+
+        int finished = link_poll(default_link, done, LINK_QUEUE, default_link->current_timeout * 1000);
+        if (finished < 0) return -1;
+
+        for (int i = 0; i < finished; i++) {
+            if (done[i].event == LINK_FAILED) return -1;
+        }
+    }
+
+    return submitted;
+}
+
+// Sends the packet that starts at base + pos and returns how many file bytes
+// it carried. With an encoder the bytes go out compressed whenever that is
+// shorter, its matches may reach back into base before pos. Given a ring the
+// packet is queued for the framer instead. Packets are as long as the link
+// asks for at the time, scratch holds the longest it may ask for.
+static long send_data(const unsigned char* base, size_t pos, size_t end, LzEncoder* lz, unsigned char* scratch, unsigned char* order, FrameRing* packets)
+{
+    size_t chunk_size = link_payload(default_link) - PACKET_HEADER_SIZE;
+    unsigned char header[PACKET_HEADER_SIZE];
+    const unsigned char* body = base + pos;
+    size_t bytes = (end - pos < chunk_size) ? end - pos : chunk_size;
+    size_t size = bytes;
+    unsigned char C = DATA_PACKET_C;
+
+    if (lz != NULL) {
+
+        size_t limit = (end - pos < LZ_MAX_BLOCK) ? end : pos + LZ_MAX_BLOCK;
+        size_t consumed = 0;
+        size_t compressed = lz_compress(lz, base, pos, limit, scratch, chunk_size, &consumed);
+
+        if (consumed > compressed) {
+            body = scratch;
+            bytes = consumed;
+            size = compressed;
+            C = COMPRESSED_PACKET_C;
+            compressed_packets++;
+        }
+
+    }
+
+    data_packet_header(header, *order, size);
+    header[0] = C;
+
+    if (packets != NULL) {
+
+        RingSlot* slot = ring_slot_to_fill(packets);
+        memcpy(slot->buffer.array, header, PACKET_HEADER_SIZE);
+        memcpy(slot->buffer.array + PACKET_HEADER_SIZE, body, size);
+        slot->buffer.used = PACKET_HEADER_SIZE + size;
+        ring_publish(packets);
+
+    } else {
+
+        struct iovec packet[2] = { { header, PACKET_HEADER_SIZE }, { (void *) body, size } };
+        if (submit_packet(packet, 2) < 0) return -1;
+
+    }
+
+    (*order)++;
+    data_packets++;
+    data_bytes += bytes;
+    packet_bytes += size;
+
+    return bytes;
+}
+
+static void record_file(const char* name, long bytes, double ms)
+{
+    if (files_done == files_capacity) {
+        files_capacity = files_capacity ? 2 * files_capacity : 16;
+        file_stats = (FileStats *) track_realloc(file_stats, files_capacity * sizeof(FileStats));
+    }
+
+    FileStats* stats = &file_stats[files_done++];
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+    stats->bytes = bytes;
+    stats->ms = ms;
+}
+
+static void print_session(double session_ms)
+{
+    long total = 0;
+    double busy_ms = 0;
+
+    for (int i = 0; i < files_done; i++) {
+        FileStats* stats = &file_stats[i];
+        double rate = stats->ms > 0 ? stats->bytes / stats->ms : 0;
+        printf("  %s: %ld bytes in %.1f ms (%.1f KB/s)\n", stats->name, stats->bytes, stats->ms, rate);
+        total += stats->bytes;
+        busy_ms += stats->ms;
+    }
+
+    // the session figure includes llopen() and llclose(), paid once for all files
+    printf("Files: %d, %ld bytes\n", files_done, total);
+    if (busy_ms > 0) printf("Transfer throughput: %.1f KB/s\n", total / busy_ms);
+    if (session_ms > 0) printf("Session throughput: %.1f KB/s over %.1f ms\n", total / session_ms, session_ms);
+
+    free(file_stats);
+    file_stats = NULL;
+}
+
+// Reserves size bytes for a file about to be written in place. Filesystems
+// that cannot do that just get the writes, anything else fails the transfer.
+static int reserve_file(int file, long size)
+{
+    if (size <= 0 || fallocate(file, 0, 0, size) == 0 || errno == EOPNOTSUPP) return 0;
+
+    perror("fallocate");
+    return -1;
+}
+
+static void save_checkpoint()
+{
+    if (checkpoint.fd < 0) return;
+
+    // the data has to be on disk before the checkpoint claims it
+    fdatasync(checkpoint.file);
+
+    // fixed width numbers, so every record overwrites the last one exactly
+    char record[320];
+    int size = snprintf(record, sizeof(record), "%020ld %020ld\n%s\n", checkpoint.size, checkpoint.offset, checkpoint.name);
+    pwrite(checkpoint.fd, record, size, 0);
+
+    checkpoint.saved = checkpoint.offset;
+}
+
+static void start_checkpoint(const char* path, const char* name, long size, int file, long offset)
+{
+    static bool registered = false;
+
+    snprintf(checkpoint.path, sizeof(checkpoint.path), "%s.checkpoint", path);
+    snprintf(checkpoint.name, sizeof(checkpoint.name), "%s", name);
+    checkpoint.file = file;
+    checkpoint.size = size;
+    checkpoint.offset = offset;
+
+    checkpoint.fd = open(checkpoint.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (checkpoint.fd < 0) {
+        perror(checkpoint.path);
+        return;
+    }
+
+    // a transfer that dies exit()s, which still records how far it got
+    if (!registered) atexit(save_checkpoint);
+    registered = true;
+
+    save_checkpoint();
+}
+
+static void finish_checkpoint()
+{
+    if (checkpoint.fd < 0) return;
+
+    close(checkpoint.fd);
+    unlink(checkpoint.path);
+    checkpoint.fd = -1;
+}
+
+// Offset a checkpoint left for this very file, or 0
+static long read_checkpoint(const char* path, const char* name, long size)
+{
+    char checkpoint_path[PATH_MAX];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.checkpoint", path);
+
+    FILE* f = fopen(checkpoint_path, "r");
+    if (f == NULL) return 0;
+
+    long saved_size = 0;
+    long offset = 0;
+    char saved_name[256];
+    int fields = fscanf(f, "%ld %ld\n%255[^\n]", &saved_size, &offset, saved_name);
+    fclose(f);
+
+    if (fields != 3 || saved_size != size || strcmp(saved_name, name) != 0) return 0;
+    if (offset < 0 || offset > size) return 0;
+
+    return offset;
+}
+
+// Transmitter side of a resume. The receiver offers the offset of its
+// checkpoint with a checksum of what it holds before it, which is taken
+// only if our own file starts the same way. The answer settles the offset.
+static long answer_resume(FILE* file, long file_size, const char* name)
+{
+    unsigned char* reply = (unsigned char *) track_realloc(NULL, llmaxpayload());
+
+    long offered = 0;
+    uint32_t checksum = 0;
+    int size = llread(reply);
+    if (size <= 0 || parse_resume_packet(reply, size, &offered, &checksum) != 0) {
+        exit(-1);
+    }
+
+    free(reply);
+
+    long offset = 0;
+    uint32_t own = 0;
+
+    if (offered > 0 && offered <= file_size && file_checksum(fileno(file), offered, &own) == 0 && own == checksum) {
+        offset = offered;
+        printf("Resuming %s at byte %ld of %ld\n", name, offset, file_size);
+    } else if (offered > 0) {
+        printf("Receiver's copy of %s does not match, sending all of it\n", name);
+    }
+
+    Array answer;
+    init_array(&answer, 16);
+    resume_packet_create(&answer, offset, offset > 0 ? checksum : 0);
+    if (llwrite(answer.array, answer.used) <= 0) {
+        exit(-1);
+    }
+
+    free_array(&answer);
+
+    return offset;
+}
+
+// Receiver side of a resume, returns the offset the data picks up at.
+// packet is free to use, the START in it was already parsed.
+static long offer_resume(Array* packet, const char* path, const char* name, long size)
+{
+    long offered = read_checkpoint(path, name, size);
+    uint32_t checksum = 0;
+
+    if (offered > 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || file_checksum(fd, offered, &checksum) != 0) offered = 0;
+        if (fd >= 0) close(fd);
+    }
+
+    Array offer;
+    init_array(&offer, 16);
+    resume_packet_create(&offer, offered, checksum);
+    if (llwrite(offer.array, offer.used) <= 0) {
+        exit(-1);
+    }
+
+    free_array(&offer);
+
+    long offset = 0;
+    int read_bytes = llread(packet->array);
+    if (read_bytes <= 0 || parse_resume_packet(packet->array, read_bytes, &offset, &checksum) != 0) {
+        exit(-1);
+    }
+
+    if (offset != 0 && offset != offered) {
+        exit(-1);
+    }
+
+    if (offset > 0) printf("Resuming %s at byte %ld of %ld\n", path, offset, size);
+
+    return offset;
+}
+
+// The reader stage, maps or reads the file from the resume offset on and
+// turns it into DATA packets
+static void* read_data(void* arg)
+{
+    DataSource* source = (DataSource *) arg;
+    unsigned char order = 1;
+
+    unsigned char* map = MAP_FAILED;
+    if (source->file_size > 0) map = mmap(NULL, source->file_size, PROT_READ, MAP_PRIVATE, fileno(source->file), 0);
+
+    if (map != MAP_FAILED) {
+
+        madvise(map, source->file_size, MADV_SEQUENTIAL);
+
+        const unsigned char* base = map;
+        size_t pos = source->offset;
+        size_t end = source->file_size;
+
+        while (pos < end && !__atomic_load_n(&source->failed, __ATOMIC_RELAXED)) {
+
+            long bytes = send_data(base, pos, end, source->lz, source->scratch, &order, source->packets);
+            if (bytes <= 0) {
+                __atomic_store_n(&source->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+
+            pos += bytes;
+
+            // the encoder keeps 32 bit positions, so past 2 GiB its base moves up
+            if (source->lz != NULL && pos >= (1UL << 31)) {
+                size_t shift = pos - LZ_WINDOW;
+                base += shift;
+                pos -= shift;
+                end -= shift;
+                lz_shift(source->lz, shift);
+            }
+        }
+
+        munmap(map, source->file_size);
+
+    } else {
+
+        // a block is kept read ahead and, when compressing, the window behind it
+        size_t history = (source->lz != NULL) ? LZ_WINDOW : 0;
+        size_t block = (source->lz != NULL) ? LZ_MAX_BLOCK : source->chunk_size;
+        size_t capacity = history + 2 * block;
+
+        unsigned char* buffer = (unsigned char *) track_realloc(NULL, capacity);
+        fseek(source->file, source->offset, SEEK_SET);
+        size_t pos = 0;
+        size_t end = 0;
+        bool eof = false;
+
+        while (!__atomic_load_n(&source->failed, __ATOMIC_RELAXED)) {
+
+            while (!eof && end - pos < block) {
+
+                if (pos > history) {
+                    size_t shift = pos - history;
+                    memmove(buffer, buffer + shift, end - shift);
+                    pos -= shift;
+                    end -= shift;
+                    if (source->lz != NULL) lz_shift(source->lz, shift);
+                }
+
+                size_t bytes_read = fread(buffer + end, sizeof(unsigned char), capacity - end, source->file);
+                if (bytes_read == 0) eof = true;
+                end += bytes_read;
+            }
+
+            if (pos == end) break;
+
+            long bytes = send_data(buffer, pos, end, source->lz, source->scratch, &order, source->packets);
+            if (bytes <= 0) {
+                __atomic_store_n(&source->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+
+            pos += bytes;
+        }
+
+        free(buffer);
+
+    }
+
+    // an empty packet tells the framer the file is done, or that it stopped
+    if (source->packets != NULL) {
+        ring_slot_to_fill(source->packets)->buffer.used = 0;
+        ring_publish(source->packets);
+    }
+
+    return NULL;
+}
+
+// The framer stage, stuffs each packet and its FCS into a complete I-frame
+static void* frame_packets(void* arg)
+{
+    Framer* framer = (Framer *) arg;
+    int modulus = link_modulus(default_link);
+
+    while (true) {
+
+        RingSlot* packet = ring_slot_to_take(framer->packets);
+        RingSlot* frame = ring_slot_to_fill(framer->frames);
+
+        if (packet->buffer.used == 0) {
+            frame->buffer.used = 0;
+            ring_publish(framer->frames);
+            break;
+        }
+
+        // after a failure the packets are only taken off the ring, so the
+        // reader never waits on it before it sees the flag
+        if (__atomic_load_n(framer->failed, __ATOMIC_RELAXED)) {
+            ring_release(framer->packets);
+            continue;
+        }
+
+        struct iovec iov = { packet->buffer.array, packet->buffer.used };
+        int fec = link_fec(default_link);
+        int size = link_frame(default_link, framer->seq, fec, &iov, 1, frame->buffer.array);
+        if (size < 0) {
+            __atomic_store_n(framer->failed, 1, __ATOMIC_RELAXED);
+            ring_release(framer->packets);
+            continue;
+        }
+
+        frame->buffer.used = size;
+        frame->payload = packet->buffer.used;
+        frame->fec = fec;
+        framer->seq = (framer->seq + 1) % modulus;
+
+        ring_release(framer->packets);
+        ring_publish(framer->frames);
+    }
+
+    return NULL;
+}
+
+// Sends the data of a file through three stages, reading, framing and the
+// serial port, so the next frame is ready as soon as the window opens. The
+// calling thread is the one that talks to the port. A stage that fails
+// raises source->failed and the others wind down to the end of the stream,
+// which is reported once both threads are joined.
+static int send_pipelined(DataSource* source)
+{
+    // nothing else sends I-frames until the pipeline is drained
+    Framer framer = { NULL, NULL, link_next_seq(default_link), &source->failed };
+    if (framer.seq < 0) return -1;
+
+    FrameRing* packets = (FrameRing *) track_realloc(NULL, sizeof(FrameRing));
+    FrameRing* frames = (FrameRing *) track_realloc(NULL, sizeof(FrameRing));
+    ring_init(packets, llmaxpayload());
+    ring_init(frames, link_frame_size(default_link));
+
+    framer.packets = packets;
+    framer.frames = frames;
+    source->packets = packets;
+
+    pthread_t reader_thread;
+    pthread_t framer_thread;
+    pthread_create(&reader_thread, NULL, read_data, source);
+    pthread_create(&framer_thread, NULL, frame_packets, &framer);
+
+    while (true) {
+
+        RingSlot* frame = ring_slot_to_take(frames);
+        if (frame->buffer.used == 0) break;
+
+        // frames keep being taken after a failure, until the framer's end marker
+        if (!__atomic_load_n(&source->failed, __ATOMIC_RELAXED) &&
+            link_send_frame(default_link, frame->buffer.array, frame->buffer.used, frame->payload, frame->fec) <= 0) {
+            __atomic_store_n(&source->failed, 1, __ATOMIC_RELAXED);
+        }
+
+        ring_release(frames);
+    }
+
+    pthread_join(reader_thread, NULL);
+    pthread_join(framer_thread, NULL);
+
+    ring_free(packets);
+    ring_free(frames);
+    free(packets);
+    free(frames);
+
+    return source->failed ? -1 : 0;
+}
+
+// Sends one START/DATA/END group, name is what the receiver is told
+static void send_file(const char* path, const char* name, bool batch)
+{
+    // the START packet gives the name a single length byte
+    if (strlen(name) > 255) {
+        fprintf(stderr, "Cannot send %s, its name does not fit a START packet\n", path);
+        exit(-1);
+    }
+
+    // READ FILE INFO
+
+    FILE* file = fopen(path, "r");
+    if (file == 0) {
+        fprintf(stderr, "Failed to open file. \n");
+        exit(-1);
+    }
+
+    long file_size = get_file_size(file);
+    double started = now_ms();
+
+    // START_PACKET & SEND IT TO LINKLAYER [START_PACKET = C T1 L1 V1 T2 L2 V2]
+
+    Compression compression = { compression_mode, compression_mode == COMPRESS_NONE ? 0 : LZ_MAX_BLOCK };
+
+    Array start;
+    init_array(&start, 6);
+    bool resume = RESUME && file_size >= RESUME_MIN_SIZE;
+    start_packet_create(&start, name, file_size, &compression, batch, resume, 1);
+
+    // CHECK IF RR
+    if (llwrite(start.array, start.used) <= 0) {
+        exit(-1);
+    }
+
+    free_array(&start);
+
+    long offset = resume ? answer_resume(file, file_size, name) : 0;
+
+    // READ AND SEND DATA
+    // packets are stuffed straight out of the mapped file, anything that
+    // cannot be mapped is read in chunks instead
+
+    int chunk_size = llmaxpayload() - PACKET_HEADER_SIZE;
+
+    LzEncoder* lz = NULL;
+    unsigned char* scratch = NULL;
+
+    if (compression.mode == COMPRESS_LZ) {
+        lz = (LzEncoder *) track_realloc(NULL, sizeof(LzEncoder));
+        lz_init(lz);
+        scratch = (unsigned char *) track_realloc(NULL, chunk_size);
+    }
+
+    DataSource source = { file, file_size, offset, lz, scratch, chunk_size, NULL, 0 };
+
+    // a file of a single packet goes through the link's queue, where it can
+    // share a frame with the packets around it
+    if (TX_PIPELINE && file_size - offset > chunk_size) {
+        if (send_pipelined(&source) != 0) source.failed = 1;
+    } else {
+        read_data(&source);
+    }
+
+    if (source.failed) {
+        fprintf(stderr, "Failed to send the data of %s\n", path);
+        exit(-1);
+    }
+
+    free(lz);
+    free(scratch);
+    fclose(file);
+
+    // SEND END_PACKET
+
+    Array end;
+    init_array(&end, 6);
+    end_packet_create(&end, name, file_size);
+    if (llwrite(end.array, end.used) <= 0) {
+        exit(-1);
+    }
+
+    free_array(&end);
+
+    record_file(name, file_size - offset, now_ms() - started);
+}
+
+static int send_entry(const char* path, const struct stat* sb, int type, struct FTW* ftw)
+{
+    (void) ftw;
+
+    if (type != FTW_F || !S_ISREG(sb->st_mode)) return 0;
+
+    const char* name = path + batch_root;
+    if (strlen(name) > 255) {
+        fprintf(stderr, "Skipping %s, its name does not fit a START packet\n", path);
+        return 0;
+    }
+
+    send_file(path, name, true);
+    return 0;
+}
+
+// Receives the DATA packets of the file whose START sits in packet, up to
+// its END, and tells whether the START belonged to a batch. packet is the
+// session's receive buffer, sized to the negotiated payload.
+static bool receive_file(Array* packet, const char* out_dir)
+{
+    // PARSE START_PACKET
+
+    Array rcv_filename;
+    init_array(&rcv_filename, 1);
+
+    Filesize rcv_filesize;
+    memset(&rcv_filesize, 0, sizeof(Filesize));
+
+    Compression compression;
+    bool batch;
+    bool resume;
+    int rcv_stripes;
+
+    if (parse_start_packet(packet, &rcv_filename, &rcv_filesize, &compression, &batch, &resume, &rcv_stripes) != 0) {
+        exit(-1);
+    }
+
+    // the rest of the file is on ports we are not listening to
+    if (rcv_stripes != 1) {
+        fprintf(stderr, "File is striped over %d ports, receive it on as many\n", rcv_stripes);
+        exit(-1);
+    }
+
+    const char* name = (const char*) rcv_filename.array;
+
+    double started = now_ms();
+
+    // CREATE DESTINATION FILE
+    // reserved up front so the file is laid out in one piece, packets are
+    // then written in place at their offsets
+    Array str;
+    init_array(&str, 1);
+
+    if (!batch) {
+        create_filename(&str, &rcv_filename);
+    } else if (batch_filename(&str, out_dir, &rcv_filename) != 0 || make_parents((char*) str.array) != 0) {
+        fprintf(stderr, "Refusing to write %s\n", (char*) rcv_filename.array);
+        exit(-1);
+    }
+
+    char* path = (char*) str.array;
+    long offset = resume ? offer_resume(packet, path, name, rcv_filesize.filesize) : 0;
+
+    // a resumed file keeps what it already holds
+    int file = open(path, O_WRONLY | O_CREAT | (offset > 0 ? 0 : O_TRUNC), 0644);
+    if (file < 0) {
+        perror(path);
+        exit(-1);
+    }
+
+    if (reserve_file(file, rcv_filesize.filesize) != 0) {
+        exit(-1);
+    }
+
+    if (resume) start_checkpoint(path, name, rcv_filesize.filesize, file, offset);
+
+    // compressed packets expand behind the last LZ_WINDOW bytes of the
+    // file, which their matches copy from
+    unsigned char* window = NULL;
+    size_t window_pos = 0;
+    size_t window_size = 0;
+    // parse_start_packet() only takes a positive block size
+    size_t block = ((size_t) compression.block_size > packet->size) ? (size_t) compression.block_size : packet->size;
+
+    if (compression.mode != COMPRESS_NONE) {
+        window_size = LZ_WINDOW + 2 * block;
+        window = (unsigned char *) track_realloc(NULL, window_size);
+    }
+
+    // WRITE FILE
+
+    int end = FALSE;
+    long total_size = offset;
+    unsigned char order = 1;
+    while (!end) {
+        int read_bytes = llread(packet->array);
+        if (read_bytes <= 0) {
+            exit(-1);
+        }
+
+        switch (packet->array[0]) {
+            case DATA_PACKET_C:
+            case COMPRESSED_PACKET_C:
+                if (order != packet->array[1]) {
+                    exit(-1);
+                }
+
+                order++;
+
+                int buf_size = packet->array[2] * 256 + packet->array[3];
+                if (buf_size > read_bytes - PACKET_HEADER_SIZE) {
+                    exit(-1);
+                }
+
+                unsigned char* data = packet->array + PACKET_HEADER_SIZE;
+                int data_size = buf_size;
+
+                if (window != NULL) {
+
+                    if (window_pos + block > window_size) {
+                        memmove(window, window + window_pos - LZ_WINDOW, LZ_WINDOW);
+                        window_pos = LZ_WINDOW;
+                    }
+
+                    // stored packets go through the window too, later matches may point into them
+                    if (packet->array[0] == COMPRESSED_PACKET_C) {
+                        long expanded = lz_decompress(data, buf_size, window, window_pos, window_size);
+                        if (expanded < 0) {
+                            fprintf(stderr, "Malformed compressed packet %d\n", packet->array[1]);
+                            exit(-1);
+                        }
+                        data_size = expanded;
+                        compressed_packets++;
+                    } else {
+                        memcpy(window + window_pos, data, buf_size);
+                    }
+
+                    data = window + window_pos;
+                    window_pos += data_size;
+
+                } else if (packet->array[0] == COMPRESSED_PACKET_C) {
+                    exit(-1);
+                }
+
+                // WRITE BUFFER TO THE FILE
+                if (pwrite(file, data, data_size, total_size) != data_size) {
+                    perror("pwrite");
+                    exit(-1);
+                }
+
+                total_size += data_size;
+                packet_bytes += buf_size;
+                data_packets++;
+
+                if (checkpoint.fd >= 0) {
+                    checkpoint.offset = total_size;
+                    if (total_size - checkpoint.saved >= CHECKPOINT_BYTES) save_checkpoint();
+                }
+                break;
+
+            case END_PACKET_C:
+                end = TRUE;
+                // whatever was reserved but never arrived is given back
+                if (ftruncate(file, total_size) != 0) {
+                    perror("ftruncate");
+                    exit(-1);
+                }
+                finish_checkpoint();
+                close(file);
+                break;
+            default:
+                exit(-1);
+                break;
+        }
+    }
+
+    data_bytes += total_size - offset;
+
+    record_file(path, total_size - offset, now_ms() - started);
+
+    free(window);
+    free_array(&str);
+    free_array(&rcv_filename);
+
+    return batch;
+}
+
+// One link of a striped transmission. Links claim the next chunk of the
+// file as soon as they are ready to send it, so each one carries as much
+// as its own throughput allows.
+static int send_stripe(LinkContext* ll, int index, int count, const char* filename, const unsigned char* map, long file_size)
+{
+    double started = now_ms();
+
+    Compression compression = { COMPRESS_NONE, 0 };
+
+    Array start;
+    init_array(&start, 6);
+    start_packet_create(&start, filename, file_size, &compression, false, false, count);
+    int written = link_write(ll, start.array, start.used);
+    free_array(&start);
+    if (written <= 0) {
+        return -1;
+    }
+
+    unsigned char header[STRIPE_HEADER_SIZE];
+    unsigned char order = 1;
+
+    while (true) {
+
+        // the link's quality monitor may ask for other sizes as it goes
+        int chunk_size = link_payload(ll) - STRIPE_HEADER_SIZE;
+        long offset = __atomic_fetch_add(&stripes.next, chunk_size, __ATOMIC_RELAXED);
+        if (offset >= file_size) break;
+
+        int bytes = (file_size - offset < chunk_size) ? file_size - offset : chunk_size;
+        stripe_packet_header(header, order, bytes, offset);
+
+        struct iovec packet[2] = { { header, STRIPE_HEADER_SIZE }, { (void *) (map + offset), bytes } };
+        if (link_writev(ll, packet, 2) <= 0) {
+            return -1;
+        }
+
+        order++;
+        stripes.bytes[index] += bytes;
+    }
+
+    Array end;
+    init_array(&end, 6);
+    end_packet_create(&end, filename, file_size);
+    written = link_write(ll, end.array, end.used);
+    free_array(&end);
+    if (written <= 0) {
+        return -1;
+    }
+
+    stripes.ms[index] = now_ms() - started;
+    return 0;
+}
+
+// One link of a striped reception. Every packet says where it belongs, so
+// the links write into the one file side by side.
+static int receive_stripe(LinkContext* ll, int index, int count)
+{
+    Array packet;
+    init_array(&packet, MAX_FRAME_PAYLOAD);
+
+    Array rcv_filename;
+    init_array(&rcv_filename, 1);
+
+    Array str;
+    init_array(&str, 1);
+
+    int file = -1;
+    int result = -1;
+
+    int size = link_read(ll, packet.array);
+    if (size <= 0) {
+        goto done;
+    }
+    packet.used = size;
+
+    Filesize rcv_filesize;
+    memset(&rcv_filesize, 0, sizeof(Filesize));
+
+    Compression compression;
+    bool batch;
+    bool resume;
+    int rcv_stripes;
+
+    if (parse_start_packet(&packet, &rcv_filename, &rcv_filesize, &compression, &batch, &resume, &rcv_stripes) != 0) {
+        goto done;
+    }
+
+    if (rcv_stripes != count || batch || resume || compression.mode != COMPRESS_NONE) {
+        fprintf(stderr, "Transmitter is not striping over %d ports\n", count);
+        goto done;
+    }
+
+    double started = now_ms();
+    long file_size = rcv_filesize.filesize;
+    __atomic_store_n(&stripes.size, file_size, __ATOMIC_RELAXED);
+
+    packet.size = link_maxpayload(ll);
+    packet.array = (unsigned char *) track_realloc(packet.array, packet.size);
+
+    create_filename(&str, &rcv_filename);
+
+    // every link opens the file, none of them may throw away what the others wrote
+    file = open((char*) str.array, O_WRONLY | O_CREAT, 0644);
+    if (file < 0) {
+        perror((char*) str.array);
+        goto done;
+    }
+
+    if (reserve_file(file, file_size) != 0) {
+        goto done;
+    }
+
+    int end = FALSE;
+    unsigned char order = 1;
+    while (!end) {
+        int read_bytes = link_read(ll, packet.array);
+        if (read_bytes <= 0) {
+            goto done;
+        }
+
+        switch (packet.array[0]) {
+            case STRIPE_PACKET_C:
+                if (order != packet.array[1]) {
+                    goto done;
+                }
+
+                order++;
+
+                int buf_size = packet.array[2] * 256 + packet.array[3];
+                if (buf_size > read_bytes - STRIPE_HEADER_SIZE) {
+                    goto done;
+                }
+
+                long offset = 0;
+                for (int i = 0; i < 8; i++) {
+                    offset = (offset << 8) | packet.array[PACKET_HEADER_SIZE + i];
+                }
+
+                if (offset < 0 || offset + buf_size > file_size) {
+                    goto done;
+                }
+
+                if (pwrite(file, packet.array + STRIPE_HEADER_SIZE, buf_size, offset) != buf_size) {
+                    perror("pwrite");
+                    goto done;
+                }
+
+                stripes.bytes[index] += buf_size;
+                break;
+
+            case END_PACKET_C:
+                end = TRUE;
+                // the size is the same for every link, whichever gets here first
+                if (ftruncate(file, file_size) != 0) {
+                    perror("ftruncate");
+                    goto done;
+                }
+                break;
+            default:
+                goto done;
+                break;
+        }
+    }
+
+    stripes.ms[index] = now_ms() - started;
+    result = 0;
+
+done:
+    // every way out, good or bad, gives back the buffers and the file
+    if (file >= 0) close(file);
+    free_array(&packet);
+    free_array(&str);
+    free_array(&rcv_filename);
+
+    return result;
+}
+
+// Opens, runs and closes one link of a striped transfer. Each port gets a
+// LinkContext and a thread of its own, none of them shares link state.
+static void* run_stripe(void* arg)
+{
+    StripeLink* stripe = (StripeLink *) arg;
+
+    LinkContext* ll = link_open(stripe->link_info);
+    if (ll == NULL) {
+        stripe->result = -1;
+        return NULL;
+    }
+
+    if (stripe->link_info.role == LlTx) {
+        stripe->result = send_stripe(ll, stripe->index, stripe->count, stripe->filename, stripe->map, stripe->file_size);
+    } else {
+        stripe->result = receive_stripe(ll, stripe->index, stripe->count);
+    }
+
+    // one that failed is torn down all the same, link_close() frees it either way
+    if (stripe->result == 0) {
+        if (link_close(ll, 1) != 0) stripe->result = -1;
+    } else {
+        link_close(ll, 0);
+    }
+
+    return NULL;
+}
+
+// A comma separated list of ports spreads one file over all of them, each
+// driven by its own thread. They claim chunks from one shared offset and
+// keep their counters side by side.
+static void run_striped(LinkLayer* link_info, char ports[][50], int count, const char* filename)
+{
+    memset(&stripes, 0, sizeof(Stripes));
+
+    unsigned char* map = NULL;
+    long file_size = 0;
+
+    if (link_info->role == LlTx) {
+
+        FILE* file = fopen(filename, "r");
+        if (file == 0) {
+            fprintf(stderr, "Failed to open file. \n");
+            exit(-1);
+        }
+
+        file_size = get_file_size(file);
+
+        if (file_size > 0) {
+            map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+            if (map == MAP_FAILED) {
+                perror(filename);
+                exit(-1);
+            }
+        }
+
+        fclose(file);
+        stripes.size = file_size;
+    }
+
+    double session_start = now_ms();
+    StripeLink links[MAX_STRIPES];
+    pthread_t threads[MAX_STRIPES];
+
+    for (int i = 0; i < count; i++) {
+
+        links[i] = (StripeLink) { *link_info, i, count, filename, map, file_size, -1 };
+        strcpy(links[i].link_info.serialPort, ports[i]);
+
+        if (pthread_create(&threads[i], NULL, run_stripe, &links[i]) != 0) {
+            fprintf(stderr, "Failed to start the link on %s\n", ports[i]);
+            exit(-1);
+        }
+    }
+
+    bool failed = false;
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        if (links[i].result != 0) failed = true;
+    }
+
+    double session_ms = now_ms() - session_start;
+    long total = 0;
+
+    for (int i = 0; i < count; i++) {
+        double rate = stripes.ms[i] > 0 ? stripes.bytes[i] / stripes.ms[i] : 0;
+        printf("  %s: %ld bytes in %.1f ms (%.1f KB/s)\n", ports[i], stripes.bytes[i], stripes.ms[i], rate);
+        total += stripes.bytes[i];
+    }
+
+    printf("Stripes: %d ports, %ld of %ld bytes\n", count, total, stripes.size);
+    if (session_ms > 0) printf("Aggregate throughput: %.1f KB/s over %.1f ms\n", total / session_ms, session_ms);
+
+    if (total != stripes.size) failed = true;
+
+    if (map != NULL) munmap(map, file_size);
+
+    if (failed) {
+        fprintf(stderr, "Striped transfer incomplete\n");
+        exit(-1);
+    }
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
@@ -13,7 +1109,6 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     link_info.baudRate = baudRate;
     link_info.nRetransmissions = nTries;
     link_info.timeout = timeout;
-    strcpy(link_info.serialPort, serialPort);
 
     if (strcmp(role, "tx") == 0) {
         link_info.role = LlTx;
@@ -21,138 +1116,124 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         link_info.role = LlRx;
     } else return;
 
-    if (llopen(link_info) != 0) exit(-1);
+    // a single file is sent under the name it was given, which has to fit
+    // the START packet; a directory's files are named relative to it
+    struct stat sb;
+    bool directory = stat(filename, &sb) == 0 && S_ISDIR(sb.st_mode);
+    if (link_info.role == LlTx && !directory && strlen(filename) > 255) {
+        fprintf(stderr, "Cannot send %s, its name does not fit a START packet\n", filename);
+        exit(-1);
+    }
 
-    if (link_info.role == LlTx) {
-        // READ FILE INFO
+    if (strchr(serialPort, ',') != NULL) {
 
-        FILE* file = fopen(filename, "r");
-        if (file == 0) {
-            fprintf(stderr, "Failed to open file. \n");
-            exit(-1);
-        }
+        char ports[MAX_STRIPES][50];
+        int count = 0;
+        const char* port = serialPort;
 
-        long file_size = get_file_size(file);
+        while (*port != '\0') {
 
-        // START_PACKET & SEND IT TO LINKLAYER [START_PACKET = C T1 L1 V1 T2 L2 V2]
+            size_t length = strcspn(port, ",");
+            if (count == MAX_STRIPES || length == 0 || length >= sizeof(ports[0])) {
+                fprintf(stderr, "Expected up to %d comma separated ports\n", MAX_STRIPES);
+                exit(-1);
+            }
 
-        Array start;
-        init_array(&start, 6);
-        start_packet_create(&start, (const char *) filename, file_size);
+            memcpy(ports[count], port, length);
+            ports[count++][length] = '\0';
 
-        // CHECK IF RR
-        if (llwrite(start.array, start.used) <= 0) {
-            exit(-1);
+            port += length;
+            if (*port == ',') port++;
         }
 
-        free_array(&start);
+        run_striped(&link_info, ports, count, filename);
+        return;
+    }
 
-        // READ AND SEND DATA
+    strcpy(link_info.serialPort, serialPort);
 
-        Array packet;
-        unsigned char buffer[STD_BUFF_SIZE];
-        int bytes_read = 0;
-        unsigned char order = 1;
+    double session_start = now_ms();
+
+    if (llopen(link_info) != 0) exit(-1);
+
+    if (link_info.role == LlTx) {
+
+        // a receiver that never offered a mode fails on the first packet in it
+        if (COMPRESSION != COMPRESS_NONE && COMPRESSION <= link_compression(default_link)) {
+            compression_mode = COMPRESSION;
+        } else if (COMPRESSION != COMPRESS_NONE) {
+            printf("Receiver did not offer %s on llopen(), sending the data as it is\n", compress_name(COMPRESSION));
+        }
+
+        if (directory) {
 
-        while((bytes_read = fread(buffer, sizeof(unsigned char), STD_BUFF_SIZE, file)) > 0) {
+            // a directory goes out file by file over the one link, the
+            // receiver keeps going until SESSION_END
+            batch_root = strlen(filename);
+            while (batch_root > 0 && filename[batch_root - 1] == '/') batch_root--;
+            batch_root++;
 
-            // CREATE PACKET TO BE SENT
-            init_array(&packet, bytes_read + 4);
-            data_packet_create(&packet, order, bytes_read, buffer);
+            if (nftw(filename, send_entry, 16, FTW_PHYS) != 0) {
+                perror(filename);
+                exit(-1);
+            }
 
-            if (llwrite(packet.array, packet.used) <= 0) {
+            unsigned char session_end = SESSION_END_PACKET_C;
+            if (llwrite(&session_end, 1) <= 0) {
                 exit(-1);
             }
 
-            order++;
-            free_array(&packet);
+        } else {
+            send_file(filename, filename, false);
         }
 
-        // SEND END_PACKET
+        llclose(1);
 
-        Array end;
-        init_array(&end, 6);
-        end_packet_create(&end, filename, file_size);
-        if (llwrite(end.array, end.used) <= 0) {
-            exit(-1);
+        if (compression_mode != COMPRESS_NONE && packet_bytes > 0) {
+            printf("Compression: %s, %ld file bytes in %ld packet bytes (%.2fx)\n", compress_name(compression_mode), data_bytes, packet_bytes, (double) data_bytes / packet_bytes);
+            printf("Compressed packets: %d of %d\n", compressed_packets, data_packets);
         }
 
-        free_array(&end);
-
-        llclose(1);
+        print_session(now_ms() - session_start);
 
     } else if (link_info.role == LlRx) {
         // START_PACKET ARRIVED
 
-        Array start;
-        init_array(&start, 6);
+        Array packet;
+        // nothing is negotiated before the first llread()
+        init_array(&packet, MAX_FRAME_PAYLOAD);
 
-        if (llread(start.array) <= 0) {
+        int size = llread(packet.array);
+        if (size <= 0) {
             exit(-1);
         }
 
-        // PARSE START_PACKET
+        // the START buffer is kept for the whole session, cut down to the negotiated size
+        packet.size = llmaxpayload();
+        packet.array = (unsigned char *) track_realloc(packet.array, packet.size);
 
-        Array rcv_filename;
-        init_array(&rcv_filename, 1);
-        
-        Filesize rcv_filesize;
-        memset(&rcv_filesize, 0, sizeof(Filesize));
+        // a batch announces itself in every START and ends with SESSION_END,
+        // a single file ends the session with its END
+        while (packet.array[0] != SESSION_END_PACKET_C) {
 
-        if (parse_start_packet(&start, &rcv_filename, &rcv_filesize) != 0) {
-            exit(-1);
-        }
+            packet.used = size;
+            if (!receive_file(&packet, filename)) break;
 
-        // CREATE DESTINATION FILE
-        Array str;
-        init_array(&str, 1);
-        create_filename(&str, &rcv_filename);
-        
-        FILE* file = fopen((char*) str.array, "w");
-
-        // WRITE FILE
-        Array packet, buffer;
-        init_array(&packet, STD_BUFF_SIZE*2);
-        init_array(&buffer, STD_BUFF_SIZE);
-
-        int end = FALSE;
-        int total_size = 0;
-        unsigned char order = 1;
-        while (!end) {
-            int read_bytes = llread(packet.array);
-            if (read_bytes <= 0) {
+            size = llread(packet.array);
+            if (size <= 0) {
                 exit(-1);
             }
+        }
 
-            switch (packet.array[0]) {
-                case DATA_PACKET_C:
-                    if (order != packet.array[1]) {
-                        exit(-1);
-                    }
-
-                    order++;
-
-                    int buf_size = packet.array[2] * 256 + packet.array[3];
-
-                    get_buffer(&packet, &buffer, buf_size);
-                    total_size += buf_size;
+        free_array(&packet);
+        llclose(1);
 
-                    // WRITE BUFFER TO THE FILE
-                    fwrite(buffer.array, sizeof(char), buffer.used, file);
+        if (compressed_packets > 0) {
+            printf("Compression: %ld packet bytes expanded to %ld file bytes (%.2fx)\n", packet_bytes, data_bytes, (double) data_bytes / packet_bytes);
+            printf("Compressed packets: %d of %d\n", compressed_packets, data_packets);
+        }
 
-                    free_array(&packet); init_array(&packet, STD_BUFF_SIZE*2);
-                    free_array(&buffer); init_array(&buffer, STD_BUFF_SIZE);
-                    break;
+        print_session(now_ms() - session_start);
 
-                case END_PACKET_C:
-                    end = TRUE;
-                    fclose(file);
-                    llclose(1);
-                    break;
-                default:
-                    exit(-1);
-                    break;
-            }
-        }
     } else return;
 }
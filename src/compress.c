@@ -0,0 +1,199 @@
+#include "compress.h"
+
+#include <string.h>
+
+// A block is a run of sequences, each one a token with the literal count in
+// the high nibble and the match length minus LZ_MIN_MATCH in the low one.
+// Either nibble at 15 continues in bytes that are added up until one is not
+// 255. The literals follow the token, then a little endian 16 bit offset and
+// the rest of the match length. The last sequence of a block may stop after
+// its literals.
+
+#define LZ_RUN_MASK 15
+
+static inline uint32_t load_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline size_t length_size(size_t length) {
+    return length >= LZ_RUN_MASK ? (length - LZ_RUN_MASK) / 255 + 1 : 0;
+}
+
+static size_t write_length(unsigned char* out, size_t length) {
+
+    size_t size = 0;
+
+    for (length -= LZ_RUN_MASK; length >= 255; length -= 255) {
+        out[size++] = 255;
+    }
+    out[size++] = length;
+
+    return size;
+
+}
+
+static int read_length(const unsigned char** in, const unsigned char* end, size_t* length) {
+
+    unsigned char b;
+
+    do {
+        if (*in >= end) return -1;
+        b = *(*in)++;
+        *length += b;
+    } while (b == 255);
+
+    return 0;
+
+}
+
+void lz_init(LzEncoder* e) {
+    memset(e->table, 0, sizeof(e->table));
+}
+
+// The caller dropped the first shift bytes of its buffer
+void lz_shift(LzEncoder* e, size_t shift) {
+
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) {
+        e->table[i] = e->table[i] > shift ? e->table[i] - shift : 0;
+    }
+
+}
+
+// Compresses base[pos, end) into at most capacity bytes and sets consumed to
+// how much of it made it in, which is less than all of it once out is full.
+// Matches may reach into base before pos, the decoder has those bytes too.
+size_t lz_compress(LzEncoder* e, const unsigned char* base, size_t pos, size_t end, unsigned char* out, size_t capacity, size_t* consumed) {
+
+    size_t anchor = pos;
+    size_t ip = pos;
+    size_t op = 0;
+    int misses = 0;
+
+    while (ip + LZ_MIN_MATCH <= end) {
+
+        uint32_t v = load_le32(base + ip);
+        uint32_t* slot = &e->table[lz_hash(v)];
+        size_t ref = *slot;
+        *slot = ip + 1;
+
+        if (ref == 0 || ref - 1 >= ip || ip - (ref - 1) > LZ_MAX_OFFSET || load_le32(base + ref - 1) != v) {
+            // incompressible stretches are skipped faster the longer they get
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+
+        ref--;
+        misses = 0;
+
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < end && base[ref + length] == base[ip + length]) length++;
+
+        while (ip > anchor && ref > 0 && base[ip - 1] == base[ref - 1]) {
+            ip--;
+            ref--;
+            length++;
+        }
+
+        size_t literals = ip - anchor;
+        size_t match = length - LZ_MIN_MATCH;
+        size_t sequence = 1 + length_size(literals) + literals + 2 + length_size(match);
+        if (op + sequence > capacity) break;
+
+        unsigned char* token = out + op++;
+        *token = (literals < LZ_RUN_MASK ? literals : LZ_RUN_MASK) << 4;
+        if (literals >= LZ_RUN_MASK) op += write_length(out + op, literals);
+        memcpy(out + op, base + anchor, literals);
+        op += literals;
+
+        out[op++] = (ip - ref) & 0xFF;
+        out[op++] = (ip - ref) >> 8;
+        *token |= match < LZ_RUN_MASK ? match : LZ_RUN_MASK;
+        if (match >= LZ_RUN_MASK) op += write_length(out + op, match);
+
+        ip += length;
+        anchor = ip;
+
+        // the end of a match is where the next repeat tends to start
+        if (ip + 2 <= end) e->table[lz_hash(load_le32(base + ip - 2))] = ip - 1;
+
+    }
+
+    // whatever is left goes out as literals, as far as it fits
+    size_t literals = end - anchor;
+    size_t room = capacity - op;
+    if (literals > room) literals = room;
+    while (literals > 0 && 1 + length_size(literals) + literals > room) literals--;
+
+    if (literals > 0) {
+        out[op++] = (literals < LZ_RUN_MASK ? literals : LZ_RUN_MASK) << 4;
+        if (literals >= LZ_RUN_MASK) op += write_length(out + op, literals);
+        memcpy(out + op, base + anchor, literals);
+        op += literals;
+    }
+
+    *consumed = anchor + literals - pos;
+    return op;
+
+}
+
+// Expands a block to base + pos, matches copy from what already sits before
+// it. Returns the number of bytes produced or -1 for a malformed block.
+long lz_decompress(const unsigned char* in, size_t size, unsigned char* base, size_t pos, size_t capacity) {
+
+    const unsigned char* end = in + size;
+    size_t op = pos;
+
+    while (in < end) {
+
+        unsigned char token = *in++;
+
+        size_t literals = token >> 4;
+        if (literals == LZ_RUN_MASK && read_length(&in, end, &literals) < 0) return -1;
+        if (literals > (size_t) (end - in) || literals > capacity - op) return -1;
+
+        memcpy(base + op, in, literals);
+        in += literals;
+        op += literals;
+
+        if (in == end) break;
+        if (end - in < 2) return -1;
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        size_t length = token & LZ_RUN_MASK;
+        if (length == LZ_RUN_MASK && read_length(&in, end, &length) < 0) return -1;
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || length > capacity - op) return -1;
+
+        unsigned char* dst = base + op;
+        const unsigned char* src = dst - offset;
+
+        // overlapping matches repeat the bytes they just wrote
+        if (offset >= length) {
+            memcpy(dst, src, length);
+        } else {
+            for (size_t i = 0; i < length; i++) dst[i] = src[i];
+        }
+
+        op += length;
+
+    }
+
+    return op - pos;
+
+}
+
+const char* compress_name(CompressMode mode) {
+
+    switch (mode) {
+        case COMPRESS_LZ: return "LZ77";
+        default: return "none";
+    }
+
+}
@@ -0,0 +1,204 @@
+#include "crc.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CRC_X86
+#endif
+
+// Reflected polynomials, all three are sent least significant byte first
+#define CRC16_POLY 0x8408
+#define CRC32_POLY 0xEDB88320
+#define CRC32C_POLY 0x82F63B78
+
+// What the register holds after running over a frame and its own FCS
+#define CRC16_RESIDUE 0xF0B8
+#define CRC32_RESIDUE 0xDEBB20E3
+#define CRC32C_RESIDUE 0xB798B438
+
+static uint32_t crc_tables[3][8][256];
+
+__attribute__((constructor))
+static void crc_tables_init(void) {
+
+    const uint32_t polys[3] = { CRC16_POLY, CRC32_POLY, CRC32C_POLY };
+
+    for (int t = 0; t < 3; t++) {
+
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t crc = b;
+            for (int k = 0; k < 8; k++) {
+                crc = (crc & 1) ? (crc >> 1) ^ polys[t] : crc >> 1;
+            }
+            crc_tables[t][0][b] = crc;
+        }
+
+        // slice k advances a byte that sits k positions ahead in the block
+        for (int k = 1; k < 8; k++) {
+            for (int b = 0; b < 256; b++) {
+                uint32_t prev = crc_tables[t][k-1][b];
+                crc_tables[t][k][b] = (prev >> 8) ^ crc_tables[t][0][prev & 0xFF];
+            }
+        }
+
+    }
+
+}
+
+static inline uint32_t load_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Slicing-by-8, works for any reflected CRC up to 32 bits wide
+static uint32_t crc_slice8(uint32_t (*T)[256], uint32_t crc, const unsigned char* buf, size_t size) {
+
+    while (size >= 8) {
+
+        uint32_t one = load_le32(buf) ^ crc;
+        uint32_t two = load_le32(buf + 4);
+
+        crc = T[7][one & 0xFF] ^ T[6][(one >> 8) & 0xFF] ^
+              T[5][(one >> 16) & 0xFF] ^ T[4][one >> 24] ^
+              T[3][two & 0xFF] ^ T[2][(two >> 8) & 0xFF] ^
+              T[1][(two >> 16) & 0xFF] ^ T[0][two >> 24];
+
+        buf += 8;
+        size -= 8;
+
+    }
+
+    while (size--) {
+        crc = (crc >> 8) ^ T[0][(crc ^ *buf++) & 0xFF];
+    }
+
+    return crc;
+
+}
+
+static uint32_t xor_update(uint32_t bcc, const unsigned char* buf, size_t size) {
+
+    // eight lanes at a time, folded down to one byte at the end
+    uint64_t lanes = 0;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        lanes ^= word;
+        buf += 8;
+        size -= 8;
+    }
+
+    lanes ^= lanes >> 32;
+    lanes ^= lanes >> 16;
+    lanes ^= lanes >> 8;
+    bcc ^= lanes & 0xFF;
+
+    while (size--) {
+        bcc ^= *buf++;
+    }
+
+    return bcc;
+
+}
+
+#ifdef CRC_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* buf, size_t size) {
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        size -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+
+    return crc;
+
+}
+
+#endif
+
+int fcs_size(FcsMode mode) {
+
+    switch (mode) {
+        case FCS_CRC16: return 2;
+        case FCS_CRC32:
+        case FCS_CRC32C: return 4;
+        default: return 1;
+    }
+
+}
+
+uint32_t fcs_init(FcsMode mode) {
+
+    switch (mode) {
+        case FCS_CRC16: return 0xFFFF;
+        case FCS_CRC32:
+        case FCS_CRC32C: return 0xFFFFFFFF;
+        default: return 0;
+    }
+
+}
+
+uint32_t fcs_update(FcsMode mode, uint32_t fcs, const unsigned char* buf, size_t size) {
+
+    switch (mode) {
+        case FCS_CRC16: return crc_slice8(crc_tables[0], fcs, buf, size);
+        case FCS_CRC32: return crc_slice8(crc_tables[1], fcs, buf, size);
+        case FCS_CRC32C:
+#ifdef CRC_X86
+            if (__builtin_cpu_supports("sse4.2")) return crc32c_hw(fcs, buf, size);
+#endif
+            return crc_slice8(crc_tables[2], fcs, buf, size);
+        default:
+            return xor_update(fcs, buf, size);
+    }
+
+}
+
+// Bytes that close the frame, least significant first
+int fcs_trailer_create(FcsMode mode, uint32_t fcs, unsigned char trailer[4]) {
+
+    int size = fcs_size(mode);
+    if (mode != FCS_XOR) fcs = ~fcs;
+
+    for (int i = 0; i < size; i++) {
+        trailer[i] = (fcs >> (8 * i)) & 0xFF;
+    }
+
+    return size;
+
+}
+
+// fcs ran over the whole frame, trailer included
+bool fcs_check(FcsMode mode, uint32_t fcs) {
+
+    switch (mode) {
+        case FCS_CRC16: return fcs == CRC16_RESIDUE;
+        case FCS_CRC32: return fcs == CRC32_RESIDUE;
+        case FCS_CRC32C: return fcs == CRC32C_RESIDUE;
+        default: return fcs == 0;
+    }
+
+}
+
+const char* fcs_name(FcsMode mode) {
+
+    switch (mode) {
+        case FCS_CRC16: return "CRC-16-CCITT";
+        case FCS_CRC32: return "CRC-32";
+        case FCS_CRC32C: return "CRC-32C";
+        default: return "XOR BCC2";
+    }
+
+}
@@ -0,0 +1,48 @@
+#include "frame_pool.h"
+
+void pool_init(FramePool* p, int count, size_t buffer_size) {
+
+    p->memory = (unsigned char *) track_realloc(NULL, count * buffer_size);
+    p->free = (unsigned char **) track_realloc(NULL, count * sizeof(unsigned char *));
+    p->count = count;
+    p->available = count;
+    p->buffer_size = buffer_size;
+
+    for (int i = 0; i < count; i++) {
+        p->free[i] = p->memory + i * buffer_size;
+    }
+
+}
+
+void pool_free(FramePool* p) {
+
+    free(p->memory);
+    free(p->free);
+    p->memory = NULL;
+    p->free = NULL;
+    p->count = 0;
+    p->available = 0;
+
+}
+
+bool pool_take(FramePool* p, Array* a) {
+
+    if (p->available == 0) return false;
+
+    a->array = p->free[--p->available];
+    a->size = p->buffer_size;
+    a->used = 0;
+    return true;
+
+}
+
+void pool_give(FramePool* p, Array* a) {
+
+    if (a->array == NULL) return;
+
+    p->free[p->available++] = a->array;
+    a->array = NULL;
+    a->size = 0;
+    a->used = 0;
+
+}
@@ -0,0 +1,144 @@
+#include "frame_reader.h"
+#include "stuffing.h"
+
+enum {
+    FRAME_HUNT,
+    FRAME_START
+} FRAME_STATES;
+
+void reader_init(FrameReader* r, size_t max_frame) {
+
+    r->buf = NULL;
+    r->capacity = 0;
+    r->head = 0;
+    r->tail = 0;
+    r->scanned = 0;
+    r->state = FRAME_HUNT;
+    r->bcc = 0;
+    r->fcs = FCS_XOR;
+    r->crc = 0;
+    r->read_calls = 0;
+    r->bytes_read = 0;
+
+    reader_resize(r, max_frame);
+
+}
+
+void reader_resize(FrameReader* r, size_t max_frame) {
+
+    // a partial frame, stuffed to at most twice its size, plus room to read the rest
+    size_t capacity = 4 * max_frame + READER_MIN_READ;
+
+    r->max_frame = max_frame;
+    if (capacity <= r->capacity) return;
+
+    r->buf = (unsigned char *) track_realloc(r->buf, capacity);
+    r->capacity = capacity;
+
+}
+
+void reader_free(FrameReader* r) {
+
+    free(r->buf);
+    r->buf = NULL;
+    r->capacity = 0;
+
+}
+
+int reader_fill(FrameReader* r, int fd) {
+
+    // frames are cut from one contiguous run, so a partial frame near the end
+    // is moved back to the start instead of wrapping around
+    if (r->head == r->tail) {
+        r->head = 0;
+        r->tail = 0;
+    } else if (r->capacity - r->tail < READER_MIN_READ) {
+        memmove(r->buf, r->buf + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head = 0;
+    }
+
+    int bytes = read(fd, r->buf + r->tail, r->capacity - r->tail);
+    r->read_calls++;
+
+    if (bytes > 0) {
+        r->tail += bytes;
+        r->bytes_read += bytes;
+    }
+
+    return bytes;
+
+}
+
+bool reader_pending(FrameReader* r) {
+    return r->tail != r->head;
+}
+
+bool reader_next_frame(FrameReader* r, Array* frame) {
+
+    while (r->head != r->tail) {
+
+        unsigned char* span = r->buf + r->head;
+        size_t size = r->tail - r->head;
+
+        if (r->state == FRAME_HUNT) {
+
+            unsigned char* flag = memchr(span, FLAG, size);
+            if (flag == NULL) {
+                r->head = r->tail;
+                break;
+            }
+
+            r->head += flag - span + 1;
+            r->state = FRAME_START;
+            continue;
+
+        }
+
+        // a flag may close one frame and open the next
+        if (span[0] == FLAG) {
+            r->head++;
+            continue;
+        }
+
+        // only what arrived since the last call has to be scanned again
+        unsigned char* flag = memchr(span + r->scanned, FLAG, size - r->scanned);
+        if (flag == NULL) {
+
+            if (size > 2 * r->max_frame) {
+                // longer than any frame, so this is noise
+                r->head = r->tail;
+                r->scanned = 0;
+                r->state = FRAME_HUNT;
+            } else {
+                r->scanned = size;
+            }
+            break;
+
+        }
+
+        size_t body = flag - span;
+        r->head += body + 1;
+        r->scanned = 0;
+
+        if (body > 2 * r->max_frame) continue;
+
+        if (frame->size < body) {
+            frame->array = (unsigned char *) track_realloc(frame->array, body);
+            frame->size = body;
+        }
+
+        r->crc = fcs_init(r->fcs);
+        uint32_t* crc = (r->fcs == FCS_XOR) ? NULL : &r->crc;
+
+        int used = destuff_span(frame->array, span, body, &r->bcc, r->fcs, crc);
+        if (used <= 0 || (size_t) used > r->max_frame) continue;
+
+        frame->used = used;
+        return true;
+
+    }
+
+    return false;
+
+}
@@ -0,0 +1,82 @@
+#include "frame_ring.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+void ring_init(FrameRing* r, size_t buffer_size) {
+
+    memset(r, 0, sizeof(FrameRing));
+
+    for (int i = 0; i < RING_SLOTS; i++) {
+        r->slots[i].buffer.array = (unsigned char *) track_realloc(NULL, buffer_size);
+        r->slots[i].buffer.size = buffer_size;
+    }
+
+}
+
+void ring_free(FrameRing* r) {
+
+    for (int i = 0; i < RING_SLOTS; i++) {
+        free(r->slots[i].buffer.array);
+        r->slots[i].buffer.array = NULL;
+    }
+
+}
+
+// Sleeps until counter moves on from seen. The flag is raised before the
+// last look at the counter, so the other side either sees it and wakes us
+// or moved the counter first and the futex returns straight away.
+static void wait_move(uint32_t* counter, uint32_t seen, uint32_t* waiting) {
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) == seen) {
+        syscall(SYS_futex, counter, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+}
+
+static void move(uint32_t* counter, uint32_t* waiting) {
+
+    __atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, counter, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+
+}
+
+// Next slot the producer may fill, waits while all of them are taken
+RingSlot* ring_slot_to_fill(FrameRing* r) {
+
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t head;
+
+    while (tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == RING_SLOTS) {
+        wait_move(&r->head, head, &r->producer_waiting);
+    }
+
+    return &r->slots[tail % RING_SLOTS];
+
+}
+
+void ring_publish(FrameRing* r) {
+    move(&r->tail, &r->consumer_waiting);
+}
+
+// Oldest published slot, waits while there is none
+RingSlot* ring_slot_to_take(FrameRing* r) {
+
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint32_t tail;
+
+    while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head) {
+        wait_move(&r->tail, tail, &r->consumer_waiting);
+    }
+
+    return &r->slots[head % RING_SLOTS];
+
+}
+
+void ring_release(FrameRing* r) {
+    move(&r->head, &r->producer_waiting);
+}
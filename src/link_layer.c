@@ -1,49 +1,82 @@
 // Link layer protocol implementation
 
 #include "link_layer.h"
-#include "utils.h"
+#include "link_context.h"
+#include "stuffing.h"
 #include <fcntl.h>
+#include <errno.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
-enum {
-    START,
-    FLAG_RCV,
-    A_RCV,
-    C_RCV,
-    BCC_OK,
-    STOP
-} SET_STATES;
-
-enum {
-    INFO_START,
-    INFO_FLAG_RCV,
-    INFO_A_RCV,
-    INFO_C_RCV,
-    BCC1_OK,
-    READ_DATA,
-    EXPECT_BSTUFF,
-    INFO_STOP
-} INFO_STATES;
-
-int super_state = START;
-int info_state = INFO_START;
-
-bool received_correct_message = false;
-bool received_reject = false;
-bool packet_switch = false;
-unsigned char last_char;
-
-bool reading_closing_UA = false;
-
-int packets_sent = 0;
-int packets_read = 0;
-
-int current_fd;
-int current_retries;
-LinkLayerRole current_role;
+// link the ll*() calls run on
+LinkContext* default_link = NULL;
+
+// internal helpers, only the link_*() and ll*() calls are visible outside
+static int link_disconnect(LinkContext* ll, int showStatistics);
+static void link_free(LinkContext* ll);
+
+static int read_frame(LinkContext* ll, Frame* frame);
+static int read_frame_until(LinkContext* ll, Frame* frame, double deadline);
+static bool next_frame(LinkContext* ll, Frame* frame);
+static void fec_decode(LinkContext* ll, Array* frame);
+static FcsMode reader_fcs(const LinkParams* params);
+static int build_frame(LinkContext* ll, int seq, int fec, bool aggregated, const struct iovec* iov, int iovcnt, unsigned char* out);
+static int frame_coded(LinkContext* ll, int parity, unsigned char mask, const unsigned char* header, int header_size, uint32_t fcs, const struct iovec* iov, int iovcnt, unsigned char* out);
+static int recode_frame(LinkContext* ll, int seq, const unsigned char* frame, int size, int fec, Array* slot);
+static int wait_port(LinkContext* ll, uint32_t events, double deadline);
+static int write_port(LinkContext* ll, struct iovec* iov, int count);
+static int write_block(LinkContext* ll, const unsigned char* block, int size);
+static int frames_in_flight(LinkContext* ll);
+static int send_frames(LinkContext* ll, int seq, int count);
+static int send_next(LinkContext* ll, int payload);
+static int transmit_next(LinkContext* ll, int payload);
+static int pump(LinkContext* ll);
+static int queued_run(LinkContext* ll);
+static int dequeue_run(LinkContext* ll, int count, int seq, bool failed);
+static int queue_packet(LinkContext* ll, const struct iovec* iov, int iovcnt, void* user, bool notify);
+static int flush_sends(LinkContext* ll);
+static void complete(LinkContext* ll, LinkEvent event, void* user, int size);
+static void complete_receive(LinkContext* ll, int size);
+static int receive_frame(LinkContext* ll, Frame* frame, unsigned char* packet);
+static bool store_frame(LinkContext* ll, Frame* frame);
+static int response_timeout(LinkContext* ll);
+static bool still_queued(LinkContext* ll, int seq);
+static void retransmit_from(LinkContext* ll, int seq);
+static void update_rto(LinkContext* ll, double sample);
+static void set_rto(LinkContext* ll, double value);
+static int wait_response(LinkContext* ll);
+static int take_tx_buffer(LinkContext* ll, Array* slot);
+static int handle_response(LinkContext* ll, Frame* frame);
+static void note_quality(LinkContext* ll, bool blamed);
+static void settle_timeout(LinkContext* ll, int seq, bool damaged);
+static void judge_quality(LinkContext* ll);
+static int switch_mode(LinkContext* ll);
+static bool mode_pending(LinkContext* ll);
+static void answer_mode(LinkContext* ll, Frame* frame);
+static void apply_mode(LinkContext* ll, int fec, int payload, int blamed);
+static void own_params(LinkContext* ll, LinkParams* params);
+static void xid_exchange(LinkContext* ll);
+static void answer_xid(LinkContext* ll, Frame* frame);
+static void send_response(LinkContext* ll, unsigned char response, int nr);
+static void acknowledge(LinkContext* ll, bool now);
+static void flush_ack(LinkContext* ll);
+static int ack_every(LinkContext* ll);
+static int deliver_stored(LinkContext* ll, unsigned char* packet);
+static int deliver_next(LinkContext* ll, unsigned char* packet);
+static int deliver_batched(LinkContext* ll, unsigned char* packet);
+static bool batch_pending(LinkContext* ll);
+static bool batch_well_formed(const unsigned char* data, int size);
+static void load_batch(LinkContext* ll, const unsigned char* data, int size);
+static void setup_pools(LinkContext* ll);
+static void print_reader_statistics(LinkContext* ll);
+static void print_mode_statistics(LinkContext* ll);
 
 
 ////////////////////////////////////////////////
@@ -51,11 +84,18 @@ LinkLayerRole current_role;
 ////////////////////////////////////////////////
 int llopen(LinkLayer connectionParameters)
 {
-    int fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY);
+    default_link = link_open(connectionParameters);
+    return default_link != NULL ? 0 : -1;
+}
+
+LinkContext* link_open(LinkLayer connectionParameters)
+{
+    // the port never blocks, waits go through the link's epoll set
+    int fd = open(connectionParameters.serialPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
     if (fd < 0) {
         perror(connectionParameters.serialPort);
-        return -1;
+        return NULL;
     }
 
     struct termios oldter;
@@ -63,7 +103,8 @@ int llopen(LinkLayer connectionParameters)
 
     if (tcgetattr(fd, &oldter) == -1) {
         perror("Can't fetch port settings.\n");
-        return -1;
+        close(fd);
+        return NULL;
     }
 
     memset(&newter, 0, sizeof(newter));
@@ -73,74 +114,110 @@ int llopen(LinkLayer connectionParameters)
     newter.c_oflag = 0;
 
     newter.c_lflag = 0;
-    newter.c_cc[VTIME] = connectionParameters.timeout * 10; // 4 seconds by default
+    newter.c_cc[VTIME] = 0;
     newter.c_cc[VMIN] = 0;
 
     tcflush(fd, TCIOFLUSH);
 
     if (tcsetattr(fd, TCSANOW, &newter) == -1) {
         perror("Error setting termios struct.\n");
-        return -1;
+        close(fd);
+        return NULL;
     }
 
     printf("\n\nNew termios structure set\n");
 
-    current_fd = fd;
-    current_retries = connectionParameters.nRetransmissions;
-    current_role = connectionParameters.role;
+    LinkContext* ll = (LinkContext *) track_realloc(NULL, sizeof(LinkContext));
+    memset(ll, 0, sizeof(LinkContext));
+
+    // input on the port and the timer of whatever the link waits on
+    ll->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ll->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ll->port_events = EPOLLIN;
+
+    struct epoll_event port = { .events = EPOLLIN, .data.fd = fd };
+    struct epoll_event timer = { .events = EPOLLIN, .data.fd = ll->timer_fd };
+
+    if (ll->epoll_fd < 0 || ll->timer_fd < 0 || epoll_ctl(ll->epoll_fd, EPOLL_CTL_ADD, fd, &port) < 0 || epoll_ctl(ll->epoll_fd, EPOLL_CTL_ADD, ll->timer_fd, &timer) < 0) {
+        perror("Can't set up the link's event loop");
+        if (ll->epoll_fd >= 0) close(ll->epoll_fd);
+        if (ll->timer_fd >= 0) close(ll->timer_fd);
+        free(ll);
+        close(fd);
+        return NULL;
+    }
+
+    ll->link_params = (LinkParams) { ARQ_STOP_AND_WAIT, 1, LEGACY_MODULUS, FCS_XOR, LEGACY_MAX_PAYLOAD, 0, false, false, false, COMPRESS_NONE };
+    ll->current_fd = fd;
+    ll->current_baudrate = connectionParameters.baudRate;
+    ll->current_retries = connectionParameters.nRetransmissions;
+    ll->current_timeout = connectionParameters.timeout;
+    ll->current_role = connectionParameters.role;
+    ll->rto = ll->current_timeout * 1000.0;
+    ll->rto_min_seen = ll->rto;
+    ll->rto_max_seen = ll->rto;
+
+    init_array(&ll->rx_frame, LEGACY_MAX_PAYLOAD + FRAME_OVERHEAD);
+    reader_init(&ll->reader, LEGACY_MAX_PAYLOAD + FRAME_OVERHEAD);
+    setup_pools(ll);
+    ll->cpu_start = clock();
 
     if (connectionParameters.role == LlTx) {
         
         unsigned char sender_block[5];
-        unsigned char read_buf;
         sender_block_create(sender_block);
 
-        write(fd, sender_block, 5);
+        write_block(ll, sender_block, 5);
         
         printf("\nSent SET block, waiting for UA response\n");
 
         int tries = 0;
+        Frame frame;
 
-        while (!received_correct_message) {
+        while (true) {
 
-            if (read(fd, &read_buf, 1) == 0) {
+            if (!read_frame(ll, &frame)) {
 
-                if (tries >= current_retries) {
+                if (tries >= ll->current_retries) {
                     fprintf(stderr, "Failed to receive UA message, connection timed out...\n");
-                    return -1;
+                    link_free(ll);
+                    return NULL;
                 }
 
                 printf("Failed to read UA frame on llopen(), retrying...\n");
                 tries++;
-                write(fd, sender_block, 5);
+                write_block(ll, sender_block, 5);
                 continue;
 
             }
 
-            ua_state_machine(read_buf);
+            if (frame.control == UA_C) break;
 
         }
         
         fprintf(stdout, "Got back UA block, connection established...\n");
-        return 0;
+
+        xid_exchange(ll);
+        return ll;
 
     } else {
 
         unsigned char receiver_block[5];
-        unsigned char read_buf;
         receiver_block_create(receiver_block);
 
         printf("\nBeginning read cycle...\n");
 
         int tries = 0;
+        Frame frame;
 
-        while (!received_correct_message) {
+        while (true) {
 
-            if (read(fd, &read_buf, 1) <= 0) {
+            if (!read_frame(ll, &frame)) {
 
-                if (tries >= current_retries) {
+                if (tries >= ll->current_retries) {
                     fprintf(stderr, "Failed to receive SET message, connection timed out...\n");
-                    return -1;
+                    link_free(ll);
+                    return NULL;
                 }
 
                 printf("Failed to read SET frame on llopen(), retrying...\n");
@@ -149,18 +226,16 @@ int llopen(LinkLayer connectionParameters)
 
             }
 
-            set_state_machine(read_buf);
+            if (frame.control == SET_C) break;
 
         }
 
-        write(fd, receiver_block, 5);
+        write_block(ll, receiver_block, 5);
 
         fprintf(stdout, "Received correct SET block and returned UA...\n\n");
-        return 0;
+        return ll;
 
     }
-
-    return -1;
 }
 
 ////////////////////////////////////////////////
@@ -168,580 +243,1960 @@ int llopen(LinkLayer connectionParameters)
 ////////////////////////////////////////////////
 int llwrite(const unsigned char* buf, int bufSize)
 {
+    return link_write(default_link, buf, bufSize);
+}
+
+int llwritev(const struct iovec* iov, int iovcnt)
+{
+    return link_writev(default_link, iov, iovcnt);
+}
 
-    unsigned char bcc2 = buf[0];
+int link_write(LinkContext* ll, const unsigned char* buf, int bufSize)
+{
+    struct iovec iov = { (void *) buf, bufSize };
+    return link_writev(ll, &iov, 1);
+}
+
+// Same as link_write() for a packet split over several buffers. Each segment
+// is stuffed straight into the frame kept for retransmission, nothing else
+// copies the payload.
+int link_writev(LinkContext* ll, const struct iovec* iov, int iovcnt)
+{
 
-    for (int i = 1; i < bufSize; i++) {
-        bcc2 ^= buf[i];
+    int bufSize = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bufSize += iov[i].iov_len;
     }
 
-    Array pre_stuff_packet;
-    Array stuffed_packet;
-    
-    init_array(&pre_stuff_packet, bufSize);
-    init_array(&stuffed_packet, bufSize * 2);
-    memcpy(pre_stuff_packet.array, buf, bufSize);
-    pre_stuff_packet.used = bufSize; 
+    // with aggregation a packet that finds the window full, or others already
+    // waiting, is copied to the queue, where the ones after it may share its
+    // frame; only a full queue blocks
+    if (ll->link_params.aggregate) {
 
-    insert_array(&pre_stuff_packet, bcc2);
+        if (pump(ll) < 0) return -1;
 
-    bstuff(&pre_stuff_packet, &stuffed_packet);
-    attach_info_frame(&stuffed_packet, packet_switch);
+        if (ll->send_count > 0 || frames_in_flight(ll) >= ll->link_params.window) {
 
-    int written_bytes = write(current_fd, stuffed_packet.array, stuffed_packet.used);
+            while (ll->send_count == LINK_QUEUE) {
+                wait_port(ll, EPOLLIN, ll->tx_deadline[ll->tx_base]);
+                if (pump(ll) < 0) return -1;
+            }
 
-    unsigned char read_buf;
-    int tries = 0;
-    super_state = START;
-    received_correct_message = false;    
+            return queue_packet(ll, iov, iovcnt, NULL, false) < 0 ? -1 : bufSize;
 
+        }
 
-    while (!received_correct_message) {
+    }
 
+    if (flush_sends(ll) < 0 || switch_mode(ll) < 0) return -1;
 
-        if (read(current_fd, &read_buf, 1) <= 0) {
+    // block only while the window is full
+    while (frames_in_flight(ll) >= ll->link_params.window) {
+        if (wait_response(ll) < 0) return -1;
+    }
 
+    // pool buffers fit the largest frame even if every byte needs escaping
+    Array* slot = &ll->tx_window[ll->tx_next];
+    if (take_tx_buffer(ll, slot) < 0) return -1;
 
-            if (tries >= current_retries) {
-                fprintf(stderr, "Lost connection, not getting response from receiver...\n");
-                return -1;
-            }
+    int size = link_frame(ll, ll->tx_next, ll->link_params.fec, iov, iovcnt, slot->array);
+    if (size < 0) {
+        pool_give(&ll->tx_pool, slot);
+        return -1;
+    }
 
-            printf("Failed to read response frame on llwrite(), retrying...\n");
-            tries++;
-            written_bytes = write(current_fd, stuffed_packet.array, stuffed_packet.used);
-            continue;
-        
+    slot->used = size;
+    return send_next(ll, bufSize);
+}
+
+// Sends a frame link_frame() built ahead of time for N(S) tx_next and FEC
+// level fec. Only the window wait and one copy into the retransmission
+// buffer are left to do, unless the level changed since.
+int link_send_frame(LinkContext* ll, const unsigned char* frame, int size, int payload, int fec)
+{
+
+    if (flush_sends(ll) < 0 || switch_mode(ll) < 0) return -1;
+
+    while (frames_in_flight(ll) >= ll->link_params.window) {
+        if (wait_response(ll) < 0) return -1;
+    }
+
+    Array* slot = &ll->tx_window[ll->tx_next];
+    if (take_tx_buffer(ll, slot) < 0) return -1;
+
+    if (fec != ll->link_params.fec) {
+        if (recode_frame(ll, ll->tx_next, frame, size, fec, slot) < 0) {
+            pool_give(&ll->tx_pool, slot);
+            return -1;
         }
+        return send_next(ll, payload);
+    }
 
+    memcpy(slot->array, frame, size);
+    slot->used = size;
+    return send_next(ll, payload);
+}
 
-        if (llwrite_state_machine(read_buf) == -1) {
-            tries++;
+// Takes the buffer I-frame tx_next is kept in until it is acknowledged.
+// There is one per frame of the window, so with the window open one is
+// normally free; otherwise the frames in flight give theirs back as their
+// acknowledgements come in. With none in flight a buffer was lost.
+static int take_tx_buffer(LinkContext* ll, Array* slot)
+{
+    while (!pool_take(&ll->tx_pool, slot)) {
 
-            if (tries >= current_retries) {
-                fprintf(stderr, "Received 3 rejects in a row, leaving...\n");
-                return -1;
-            }
+        if (frames_in_flight(ll) == 0) {
+            fprintf(stderr, "No buffer left for I-frame %d\n", ll->tx_next);
+            return -1;
+        }
+
+        if (wait_response(ll) < 0) return -1;
+    }
+
+    return 0;
+}
 
-            written_bytes = write(current_fd, stuffed_packet.array, stuffed_packet.used);
+// Builds I-frame seq into slot at the current FEC level from the same frame
+// coded for fec, which may be in slot already. It is one of ours, so the
+// packet is just what is left once the stuffing, the parity, the header
+// and the FCS are taken off.
+static int recode_frame(LinkContext* ll, int seq, const unsigned char* frame, int size, int fec, Array* slot)
+{
+    if (ll->recode.size < link_frame_size(ll)) {
+        ll->recode.array = (unsigned char *) track_realloc(ll->recode.array, link_frame_size(ll));
+        ll->recode.size = link_frame_size(ll);
+    }
+
+    unsigned char bcc = 0;
+    int used = destuff_span(ll->recode.array, frame + 1, size - 2, &bcc, FCS_XOR, NULL);
+    if (used < 0) return -1;
+
+    if (fec > 0) {
+        int kept = 0;
+        for (int i = 0; i < used; i += RS_BLOCK) {
+            int block = (used - i < RS_BLOCK) ? used - i : RS_BLOCK;
+            memmove(ll->recode.array + kept, ll->recode.array + i, block - fec);
+            kept += block - fec;
         }
-    
+        used = kept;
     }
 
-    if (packet_switch) packet_switch = false;
-    else packet_switch = true;
+    // only extended frames are ever coded
+    unsigned char C = ll->recode.array[1];
+    bool masked = (C == WRITE_MASK_C || C == WRITE_MASK_AGG_C);
+    bool aggregated = (C == WRITE_AGG_C || C == WRITE_MASK_AGG_C);
+    int header_size = masked ? 5 : 4;
+    struct iovec iov = { ll->recode.array + header_size, used - header_size - fcs_size(ll->link_params.fcs) };
 
-    packets_sent++;
+    // the mask is picked again along with the new frame
+    if (masked) xor_mask(iov.iov_base, iov.iov_base, iov.iov_len, ll->recode.array[3]);
 
-    return written_bytes;
+    int recoded = build_frame(ll, seq, ll->link_params.fec, aggregated, &iov, 1, slot->array);
+    if (recoded < 0) return -1;
+
+    slot->used = recoded;
+    return 0;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet)
+// Frames a packet as I-frame seq, coded with fec parity bytes, into out,
+// which must hold link_frame_size() bytes, and returns the frame length or
+// -1 when the packet does not fit. Only reads the negotiated parameters, so
+// another thread may build frames while the link is busy sending.
+int link_frame(LinkContext* ll, int seq, int fec, const struct iovec* iov, int iovcnt, unsigned char* out)
 {
-    Array packet_array;
-    init_array(&packet_array, 1);
-    free(packet_array.array);
-    packet_array.size = STD_BUFF_SIZE*2;
-    packet_array.array = packet;
-
-    unsigned char read_buf;
-    unsigned char response[5];
-    int tries = 0;
-    int bytes_read = 0;
-    info_state = INFO_START;
-    received_correct_message = false;
+    return build_frame(ll, seq, fec, false, iov, iovcnt, out);
+}
+
+// link_frame() for a frame whose data may be several length-prefixed packets
+static int build_frame(LinkContext* ll, int seq, int fec, bool aggregated, const struct iovec* iov, int iovcnt, unsigned char* out)
+{
+
+    bool extended = (ll->link_params.arq != ARQ_STOP_AND_WAIT);
 
-    bool rejected = true;
+    int bufSize = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        bufSize += iov[i].iov_len;
+    }
 
-    while (rejected) {
+    if (bufSize > ll->link_params.max_payload) {
+        fprintf(stderr, "Packet of %d bytes is larger than the %d byte frame payload\n", bufSize, ll->link_params.max_payload);
+        return -1;
+    }
 
-        while (!received_correct_message) {
+    unsigned char C = extended ? (aggregated ? WRITE_AGG_C : WRITE_EXT_C) : WRITE_C | (seq << 6);
+    unsigned char header[5];
+    int header_size = info_header_create(header, C, seq, extended);
 
-            int curr_read = read(current_fd, &read_buf, 1);
-            
-            if (curr_read <= 0) {
+    // data with many FLAG or ESCAPE_FLAG bytes goes out XORed with the mask
+    // that moves most of them out of the way, the header says which
+    unsigned char masked_C = aggregated ? WRITE_MASK_AGG_C : WRITE_MASK_C;
+    size_t saved = 0;
+    unsigned char mask = (ll->link_params.mask && extended) ? pick_mask(iov, iovcnt, header, header_size, masked_C, &saved) : 0;
 
-                if (tries >= current_retries) {
-                    fprintf(stderr, "Lost connection, not getting data from transmitter...\n");
-                    return -1;
-                }
-                printf("Failed to read information frame on llread(), retrying...\n");
-                tries++;
-                continue;
+    if (mask != 0) {
+        header_size = masked_header_create(header, masked_C, seq, mask);
+        __atomic_add_fetch(&ll->masked_frames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ll->mask_saved, saved, __ATOMIC_RELAXED);
+    }
 
-            }
+    // the FCS covers the header too and follows the data through stuff_span
+    uint32_t fcs = fcs_update(ll->link_params.fcs, fcs_init(ll->link_params.fcs), header, header_size);
+
+    if (fec > 0) return frame_coded(ll, fec, mask, header, header_size, fcs, iov, iovcnt, out);
 
-            if (info_state == READ_DATA) bytes_read += curr_read;
-            llread_state_machine(read_buf, &packet_array);
+    // masked data is laid out at the end of out, behind the room its stuffed
+    // form needs, like coded frames are
+    struct iovec masked = { out + link_frame_size(ll) - ll->link_params.max_payload, bufSize };
 
+    if (mask != 0) {
+
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            xor_mask((unsigned char *) masked.iov_base + size, iov[i].iov_base, iov[i].iov_len, mask);
+            size += iov[i].iov_len;
         }
 
-        bytes_read--; // cheeky little bcc2 innit ;)
+        iov = &masked;
+        iovcnt = 1;
+
+    }
+
+    size_t pos = 0;
+
+    out[pos++] = FLAG;
+    pos += stuff_raw(out + pos, header, header_size);
+
+    for (int i = 0; i < iovcnt; i++) {
+        pos += stuff_span(out + pos, iov[i].iov_base, iov[i].iov_len, ll->link_params.fcs, &fcs);
+    }
+
+    unsigned char trailer[4];
+    int trailer_size = fcs_trailer_create(ll->link_params.fcs, fcs, trailer);
+    pos += stuff_raw(out + pos, trailer, trailer_size);
+    out[pos++] = FLAG;
+
+    return pos;
+}
 
-        unsigned char supposed_bcc2 = packet_array.array[0];
-        for (int i = 1; i < packet_array.used; i++) {
-            supposed_bcc2 ^= packet_array.array[i];
+// link_frame() with FEC. The frame is laid out plain at the end of out,
+// behind the room its stuffed form needs, and each codeword is stuffed
+// with its parity right after it.
+static int frame_coded(LinkContext* ll, int parity, unsigned char mask, const unsigned char* header, int header_size, uint32_t fcs, const struct iovec* iov, int iovcnt, unsigned char* out)
+{
+    size_t max_raw = ll->link_params.max_payload + FRAME_OVERHEAD;
+    unsigned char* raw = out + link_frame_size(ll) - max_raw;
+    size_t size = 0;
+
+    memcpy(raw, header, header_size);
+    size += header_size;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (mask != 0) {
+            xor_mask(raw + size, iov[i].iov_base, iov[i].iov_len, mask);
+        } else {
+            memcpy(raw + size, iov[i].iov_base, iov[i].iov_len);
         }
+        fcs = fcs_update(ll->link_params.fcs, fcs, raw + size, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
 
-        if (supposed_bcc2 != last_char) {
+    size += fcs_trailer_create(ll->link_params.fcs, fcs, raw + size);
 
-            response_block_create(response, REJ_C, packet_switch);
-            write(current_fd, response, 5);
-            tries++;
-            received_correct_message = false;
-            info_state = INFO_START;
-            memset(packet_array.array, 0, packet_array.used);
-            packet_array.used = 0; // rewriting data
+    unsigned char check[RS_MAX_PARITY];
+    size_t pos = 0;
+
+    out[pos++] = FLAG;
 
-        } else rejected = false;
+    size_t span = RS_BLOCK - parity;
+
+    for (size_t i = 0; i < size; i += span) {
+        size_t data = (size - i < span) ? size - i : span;
+        rs_encode(raw + i, data, parity, check);
+        pos += stuff_raw(out + pos, raw + i, data);
+        pos += stuff_raw(out + pos, check, parity);
     }
 
-    packets_read++;
-    response_block_create(response, RR_C, packet_switch);
-    write(current_fd, response, 5);
+    out[pos++] = FLAG;
+
+    return pos;
+}
+
+// Room for the largest frame at any FEC level the link may switch to
+size_t link_frame_size(LinkContext* ll) {
 
-    if (packet_switch) packet_switch = false;
-    else packet_switch = true;
+    size_t max_raw = ll->link_params.max_payload + FRAME_OVERHEAD;
+    size_t max_frame = 2 * rs_coded_size(max_raw, ll->fec_limit) + 2;
+
+    // coded and masked frames are laid out plain behind their stuffed form first
+    return (ll->fec_limit > 0 || ll->link_params.mask) ? max_frame + max_raw : max_frame;
 
-    return bytes_read;
 }
 
-////////////////////////////////////////////////
-// LLCLOSE
-////////////////////////////////////////////////
-int llclose(int showStatistics)
-{
-    if (current_role == LlTx) {
+// FEC level new frames are coded with, the quality monitor may change it
+// between any two frames
+int link_fec(LinkContext* ll) {
+    return __atomic_load_n(&ll->link_params.fec, __ATOMIC_RELAXED);
+}
 
-        unsigned char read_buf;
-        unsigned char block[5];
-        command_block_create(block, DISC_C);
+int link_next_seq(LinkContext* ll) {
 
-        write(current_fd, block, 5);
-        
-        printf("\nSent DISC block, waiting for response...\n");
+    // packets queued for aggregation take their numbers first
+    if (flush_sends(ll) < 0) return -1;
 
-        int tries = 0;
-        received_correct_message = false;
-        super_state = START;
-        
-        while (!received_correct_message) {
+    return ll->tx_next;
 
-            int read_bytes = read(current_fd, &read_buf, 1);
-            if (read_bytes <= 0) {
+}
 
-                if (tries >= current_retries) {
-                    fprintf(stderr, "Failed to receive DISC message, connection timed out...\n");
-                    return -1;
-                }
+int link_modulus(LinkContext* ll) {
+    return ll->link_params.modulus;
+}
 
-                printf("Failed to read DISC frame on llclose(), retrying...\n");
-                tries++;
-                write(current_fd, block, 5);
-                continue;
+CompressMode link_compression(LinkContext* ll) {
+    return ll->link_params.compress;
+}
 
-            }
+// Sends the frame waiting in tx_window[tx_next] and slides the window
+static int send_next(LinkContext* ll, int payload) {
+
+    int written_bytes = transmit_next(ll, payload);
 
-            llclosetx_state_machine(read_buf);
+    // slide the window over whatever acknowledgements are already waiting
+    Frame frame;
 
+    do {
+        while (next_frame(ll, &frame)) {
+            if (handle_response(ll, &frame) < 0) return -1;
         }
-        
-        fprintf(stdout, "Got back DISC block, sending UA, file transfer successful!\n\n");
-        command_block_create(block, UA_C);
-        write(current_fd, block, 5);
+    } while (reader_fill(&ll->reader, ll->current_fd) > 0);
 
-        if (showStatistics) {
-            printf("Packets sent: %d\n", packets_sent);
+    if (ll->link_params.arq == ARQ_STOP_AND_WAIT) {
+        while (frames_in_flight(ll) > 0) {
+            if (wait_response(ll) < 0) return -1;
         }
+    }
 
-        return 0;
+    return written_bytes;
+}
 
-    } else {
+static int transmit_next(LinkContext* ll, int payload) {
 
-        unsigned char read_buf;
-        int tries = 0;
-        received_correct_message = false;
-        super_state = START;
+    // the link turns around, the peer is not kept waiting on what it sent
+    flush_ack(ll);
 
-        while (!received_correct_message) {
+    ll->tx_resent[ll->tx_next] = false;
+    ll->tx_timed_out[ll->tx_next] = false;
+    ll->tx_notify[ll->tx_next] = 0;
 
-            int read_bytes = read(current_fd, &read_buf, 1);
-            if (read_bytes == 0) {
+    int written_bytes = send_frames(ll, ll->tx_next, 1);
+    ll->tx_next = (ll->tx_next + 1) % ll->link_params.modulus;
+    ll->packets_sent++;
+    ll->payload_bytes += payload;
 
-                if (tries >= current_retries) {
-                    fprintf(stderr, "Failed to receive any DISC block after trying to close connection...\n");
-                    return -1;
-                }
+    return written_bytes;
+}
 
-                printf("Failed to read DISC frame on llclose(), retrying...\n");
-                tries++;
-                continue;
+////////////////////////////////////////////////
+// ASYNCHRONOUS REQUESTS
+////////////////////////////////////////////////
 
-            }
+// Queues a packet to be sent and returns 1 right away, or 0 while the queue
+// is full and link_poll() has completions to hand back first. The packet is
+// copied, the caller may reuse its buffers at once. Its LINK_SENT completion
+// comes once the peer acknowledged it.
+int link_submit_send(LinkContext* ll, const struct iovec* iov, int iovcnt, void* user)
+{
 
-            llcloserx_state_machine(read_buf);
+    // every send ends up as a completion, so what is still uncollected counts too
+    if (ll->send_count == LINK_QUEUE || ll->async_sends + ll->recv_count + ll->done_count >= LINK_COMPLETIONS) return 0;
 
-        }
+    if (queue_packet(ll, iov, iovcnt, user, true) < 0) return -1;
 
-        unsigned char block[5];
-        command_block_create(block, DISC_C);
+    // goes out now if the window allows
+    return pump(ll) < 0 ? -1 : 1;
+}
 
-        fprintf(stdout, "Sending DISC and awaiting UA response\n");
-        write(current_fd, block, 5);
-        tries = 0;
-        received_correct_message = false;
-        super_state = START;
+// Copies a packet to the end of the send queue, which must have room
+static int queue_packet(LinkContext* ll, const struct iovec* iov, int iovcnt, void* user, bool notify)
+{
 
-        while (!received_correct_message) {
+    int size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
 
-            if (read(current_fd, &read_buf, 1) == 0) {
+    if (size > ll->link_params.max_payload) {
+        fprintf(stderr, "Packet of %d bytes is larger than the %d byte frame payload\n", size, ll->link_params.max_payload);
+        return -1;
+    }
 
-                if (tries >= current_retries) {
-                    fprintf(stderr, "Failed to receive UA response on closing...\n");
-                    return -1;
-                }
+    LinkRequest* request = &ll->send_queue[(ll->send_head + ll->send_count) % LINK_QUEUE];
+    if (!pool_take(&ll->send_pool, &request->packet)) {
+        fprintf(stderr, "No buffer left for a queued packet\n");
+        return -1;
+    }
 
-                printf("Failed to read UA frame on llclose(), retrying...\n");
-                tries++;
-                continue;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(request->packet.array + request->packet.used, iov[i].iov_base, iov[i].iov_len);
+        request->packet.used += iov[i].iov_len;
+    }
 
-            }
+    request->user = user;
+    request->notify = notify;
+    ll->send_count++;
+    if (notify) ll->async_sends++;
 
-            llcloserx_state_machine(read_buf);
+    return 0;
+}
 
-        }
+// Hands buf, which must hold link_maxpayload() bytes, to the next packet the
+// peer sends. Returns 1, or 0 while LINK_QUEUE receives are already waiting.
+// Packets that arrive while no receive is posted wait in the receive window,
+// once that is full they are not acknowledged, so the peer repeats them.
+int link_submit_receive(LinkContext* ll, unsigned char* buf, void* user)
+{
 
-        fprintf(stdout, "Received UA response from transmitter, file transfer successful!\n\n");
-        if (showStatistics) printf("Packets read: %d\n", packets_read);
+    if (ll->recv_count == LINK_QUEUE || ll->async_sends + ll->recv_count + ll->done_count >= LINK_COMPLETIONS) return 0;
 
-        return 0;
+    LinkRequest* request = &ll->recv_queue[(ll->recv_head + ll->recv_count) % LINK_QUEUE];
+    request->packet.array = buf;
+    request->packet.used = 0;
+    request->user = user;
+    ll->recv_count++;
 
-    }
+    return 1;
 }
 
+// Runs the link until at least one request completed or timeout_ms passed
+// and copies up to max completions out. Returns how many, or -1 once the
+// link is lost.
+int link_poll(LinkContext* ll, LinkCompletion* completions, int max, int timeout_ms)
+{
 
-////////////////////////////////////////////////
-// UTILITY FUNCTIONS
-////////////////////////////////////////////////
+    double deadline = now_ms() + timeout_ms;
 
-void set_state_machine(unsigned char super_frame) {
-    switch (super_state) {
-        case START: {
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            break;
-        }
-        case FLAG_RCV: {
-            if (super_frame == SET_A) super_state = A_RCV;
-            else if (super_frame != FLAG) super_state = START;
-            break;
-        }
-        case A_RCV: {
-            if (super_frame == SET_C) super_state = C_RCV;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
-        }
-        case C_RCV: {
-            if (super_frame == (SET_A ^ SET_C)) super_state = BCC_OK;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
-        }
-        case BCC_OK: {
-            if (super_frame == FLAG) {
-                received_correct_message = true;
-                super_state = STOP;
-            }
-            else super_state = START;
-            break;
-        }
-        case STOP: {
-            break;
-        }
+    while (ll->done_count == 0) {
+
+        if (pump(ll) < 0) return -1;
+        if (ll->done_count > 0 || now_ms() >= deadline) break;
+
+        // woken by input, the deadline or the oldest frame's retransmission timer
+        double wake = deadline;
+        if (frames_in_flight(ll) > 0 && ll->tx_deadline[ll->tx_base] < wake) wake = ll->tx_deadline[ll->tx_base];
+        if (ll->acks_pending > 0 && ll->ack_deadline < wake) wake = ll->ack_deadline;
+        wait_port(ll, EPOLLIN, wake);
+
+    }
+
+    int count = 0;
+
+    while (count < max && ll->done_count > 0) {
+        completions[count++] = ll->done[ll->done_head];
+        ll->done_head = (ll->done_head + 1) % LINK_COMPLETIONS;
+        ll->done_count--;
     }
+
+    return count;
 }
 
-void ua_state_machine(unsigned char super_frame) {
-    switch (super_state) {
-        case START: {
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            break;
-        }
-        case FLAG_RCV: {
-            if (super_frame == UA_A) super_state = A_RCV;
-            else if (super_frame != FLAG) super_state = START;
-            break;
-        }
-        case A_RCV: {
-            if (super_frame == UA_C) super_state = C_RCV;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
-        }
-        case C_RCV: {
-            if (super_frame == (UA_A ^ UA_C)) super_state = BCC_OK;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
-        }
-        case BCC_OK: {
-            if (super_frame == FLAG) {
-                received_correct_message = true;
-                super_state = STOP;
+// Does whatever the link can without waiting: takes in what arrived, runs
+// the retransmission timer and sends queued packets while the window allows.
+static int pump(LinkContext* ll) {
+
+    Frame frame;
+
+    do {
+        while (next_frame(ll, &frame)) {
+
+            if (frame.control == RR_C || frame.control == REJ_C || frame.control == SREJ_C) {
+                if (handle_response(ll, &frame) < 0) return -1;
+                continue;
             }
-            else super_state = START;
-            break;
-        }
-        case STOP: {
-            break;
+
+            // a new frame waits while packets of an aggregated one are left
+            unsigned char* packet = (ll->recv_count > 0 && !batch_pending(ll)) ? ll->recv_queue[ll->recv_head].packet.array : NULL;
+            int size = receive_frame(ll, &frame, packet);
+            if (size > 0) complete_receive(ll, size);
+
         }
+    } while (reader_fill(&ll->reader, ll->current_fd) > 0);
+
+    // the rest of an aggregated frame, frames that arrived ahead of a gap and
+    // ones kept while no buffer was posted follow into the next buffers
+    while (ll->recv_count > 0 && (batch_pending(ll) || ll->rx_deliver != ll->rx_expected)) {
+        complete_receive(ll, deliver_next(ll, ll->recv_queue[ll->recv_head].packet.array));
     }
-}
 
-int llwrite_state_machine(unsigned char super_frame) {
-    
-    switch (super_state) {
-        case START: {
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            break;
-        }
-        case FLAG_RCV: {
-            if (super_frame == SET_A) super_state = A_RCV;
-            else if (super_frame != FLAG) super_state = START;
-            break;
-        }
-        case A_RCV: {
-            if (packet_switch) {
-                if (super_frame == RR_C || super_frame == REJ_C) super_state = C_RCV; 
-                break;
-            } else {
-                if (super_frame == (RR_C | BIT(7)) || super_frame == (REJ_C | BIT(7))) super_state = C_RCV; 
-                break;
+    if (ll->acks_pending > 0 && now_ms() >= ll->ack_deadline) flush_ack(ll);
+
+    if (frames_in_flight(ll) > 0 && now_ms() >= ll->tx_deadline[ll->tx_base]) {
+        if (response_timeout(ll) < 0) return -1;
+    }
+
+    // a mode change waits for the peer's echo, the one time pump() blocks
+    if (switch_mode(ll) < 0) return -1;
+
+    while (ll->send_count > 0 && frames_in_flight(ll) < ll->link_params.window) {
+
+        // packets that waited together share the frame, each behind its length
+        int count = queued_run(ll);
+        struct iovec iov[2 * LINK_QUEUE];
+        unsigned char lengths[LINK_QUEUE][SUBPACKET_HEADER_SIZE];
+        int iovcnt = 0;
+        int payload = 0;
+        int seq = ll->tx_next;
+
+        for (int i = 0; i < count; i++) {
+
+            Array* packet = &ll->send_queue[(ll->send_head + i) % LINK_QUEUE].packet;
+
+            if (count > 1) {
+                lengths[i][0] = packet->used >> 8;
+                lengths[i][1] = packet->used;
+                iov[iovcnt++] = (struct iovec) { lengths[i], SUBPACKET_HEADER_SIZE };
             }
 
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
+            iov[iovcnt++] = (struct iovec) { packet->array, packet->used };
+            payload += packet->used;
+
         }
-        case C_RCV: {
-            if (packet_switch) {
-                if (super_frame == (RR_C ^ SET_A)) { 
-                    super_state = BCC_OK; 
-                    break;
-                } else if (super_frame == (REJ_C ^ SET_A)) {
-                    super_state = BCC_OK;
-                    received_reject = true;
-                    break;
-                }
-            } else {
-
-                if (super_frame == ((RR_C | BIT(7)) ^ SET_A)) {
-                    super_state = BCC_OK; 
-                    break;
-                } else if (super_frame == ((REJ_C | BIT(7)) ^ SET_A)) {
-                    super_state = BCC_OK;
-                    received_reject = true;
-                    break;
-                }
-            }
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
+
+        // the packets stay queued until an acknowledgement frees a buffer
+        Array* slot = &ll->tx_window[seq];
+        if (!pool_take(&ll->tx_pool, slot)) {
+            if (frames_in_flight(ll) > 0) break;
+            fprintf(stderr, "No buffer left for I-frame %d\n", seq);
+            return -1;
         }
-        case BCC_OK: {
-            if (super_frame == FLAG) {
 
-                if (received_reject) {
-                    super_state = START;
-                    return -1;
-                }
-    
-                received_correct_message = true;
-                super_state = STOP;
-                
-            }
-            else super_state = START;
-            break;
+        int size = build_frame(ll, seq, ll->link_params.fec, count > 1, iov, iovcnt, slot->array);
+        if (size < 0) {
+            pool_give(&ll->tx_pool, slot);
+            if (dequeue_run(ll, count, seq, true) < 0) return -1;
+            continue;
         }
-        case STOP: {
-            break;
+
+        slot->used = size;
+
+        // a port that takes no more loses the link, the run fails with it
+        bool failed = transmit_next(ll, payload) < 0;
+
+        if (!failed && count > 1) {
+            ll->aggregated_frames++;
+            ll->aggregated_packets += count;
         }
+
+        if (dequeue_run(ll, count, seq, failed) < 0 || failed) return -1;
+
     }
 
     return 0;
 
 }
 
-void llread_state_machine(unsigned char info_frame, Array* buffer) {
+// Takes the first count queued packets off the queue once frame seq carried
+// them, or failed to. Submitted ones get their completion, LINK_FAILED right
+// away or LINK_SENT once seq is acknowledged. Returns -1 when a failed one
+// came from llwrite(), which already answered for it.
+static int dequeue_run(LinkContext* ll, int count, int seq, bool failed) {
 
-    switch (info_state) {
+    int result = 0;
+
+    for (int i = 0; i < count; i++) {
+
+        LinkRequest* request = &ll->send_queue[ll->send_head];
+
+        if (!request->notify) {
+
+            if (failed) result = -1;
+
+        } else if (failed) {
+
+            complete(ll, LINK_FAILED, request->user, -1);
+            ll->async_sends--;
+
+        } else {
+
+            // completions come in the order packets were framed, which is
+            // the order frames are acknowledged in
+            LinkCompletion* sent = &ll->sent[(ll->sent_head + ll->sent_count) % LINK_COMPLETIONS];
+            sent->event = LINK_SENT;
+            sent->user = request->user;
+            sent->size = request->packet.used;
+            ll->sent_count++;
+            ll->tx_notify[seq]++;
 
-        case INFO_START: {
-            if (info_frame == FLAG) info_state = INFO_FLAG_RCV;
-            break;
-        }
-        case INFO_FLAG_RCV: {
-            if (info_frame == SET_A) info_state = INFO_A_RCV;
-            else if (info_frame != FLAG) info_state = INFO_START;
-            break;
         }
-        case INFO_A_RCV: {
-            if (packet_switch) {
-                if (info_frame == (WRITE_C | BIT(6))) info_state = INFO_C_RCV;
-                break;
-            } else {
-                if (info_frame == WRITE_C) info_state = INFO_C_RCV;
-                break;
+
+        pool_give(&ll->send_pool, &request->packet);
+        ll->send_head = (ll->send_head + 1) % LINK_QUEUE;
+        ll->send_count--;
+
+    }
+
+    return result;
+
+}
+
+// Queued packets the next frame carries. Aggregating, as many as fit in the
+// payload the link asks for right now, otherwise one.
+static int queued_run(LinkContext* ll) {
+
+    if (!ll->link_params.aggregate) return 1;
+
+    int size = 0;
+    int count = 0;
+
+    while (count < ll->send_count) {
+
+        int used = ll->send_queue[(ll->send_head + count) % LINK_QUEUE].packet.used;
+        if (used == 0 || used > MAX_SUBPACKET || size + SUBPACKET_HEADER_SIZE + used > ll->payload) break;
+
+        size += SUBPACKET_HEADER_SIZE + used;
+        count++;
+
+    }
+
+    return count > 0 ? count : 1;
+
+}
+
+// Sends everything queued asynchronously ahead of a blocking call, so frames
+// keep the order they were handed over in
+static int flush_sends(LinkContext* ll) {
+
+    while (ll->send_count > 0) {
+        if (pump(ll) < 0) return -1;
+        if (ll->send_count > 0) wait_port(ll, EPOLLIN, ll->tx_deadline[ll->tx_base]);
+    }
+
+    return 0;
+
+}
+
+static void complete(LinkContext* ll, LinkEvent event, void* user, int size) {
+
+    LinkCompletion* done = &ll->done[(ll->done_head + ll->done_count) % LINK_COMPLETIONS];
+    done->event = event;
+    done->user = user;
+    done->size = size;
+    ll->done_count++;
+
+}
+
+static void complete_receive(LinkContext* ll, int size) {
+
+    complete(ll, LINK_RECEIVED, ll->recv_queue[ll->recv_head].user, size);
+    ll->recv_head = (ll->recv_head + 1) % LINK_QUEUE;
+    ll->recv_count--;
+
+}
+
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+int llread(unsigned char *packet)
+{
+    return link_read(default_link, packet);
+}
+
+int link_read(LinkContext* ll, unsigned char* packet)
+{
+    // the link turns around, whatever this end sent has to be acknowledged first
+    if (flush_sends(ll) < 0) return -1;
+
+    while (frames_in_flight(ll) > 0) {
+        if (wait_response(ll) < 0) return -1;
+    }
+
+    // the rest of an aggregated frame and frames that arrived ahead of a gap
+    // are handed over first
+    if (batch_pending(ll) || ll->rx_deliver != ll->rx_expected) return deliver_next(ll, packet);
+
+    Frame frame;
+    int tries = 0;
+
+    while (true) {
+
+        if (!read_frame(ll, &frame)) {
+
+            if (tries >= ll->current_retries) {
+                fprintf(stderr, "Lost connection, not getting data from transmitter...\n");
+                return -1;
             }
-            if (info_frame == FLAG) info_state = INFO_FLAG_RCV;
-            else info_state = INFO_START;
-            break;
+            printf("Failed to read information frame on llread(), retrying...\n");
+            tries++;
+            continue;
+
         }
-        case INFO_C_RCV: {
-            if (packet_switch) {
-                if (info_frame == (SET_A ^ (WRITE_C | BIT(6)))) info_state = BCC1_OK;
-                break;
-            } else {
-                if (info_frame == (SET_A ^ WRITE_C)) info_state = BCC1_OK;
-                break;
-            }
-            if (info_frame == FLAG) info_state = INFO_FLAG_RCV;
-            else info_state = INFO_START;
-            break;
+
+        int size = receive_frame(ll, &frame, packet);
+        if (size > 0) return size;
+    }
+
+    return -1;
+}
+
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+int llclose(int showStatistics)
+{
+    int result = link_close(default_link, showStatistics);
+    default_link = NULL;
+    return result;
+}
+
+int link_close(LinkContext* ll, int showStatistics)
+{
+    int result = link_disconnect(ll, showStatistics);
+    link_free(ll);
+    return result;
+}
+
+static int link_disconnect(LinkContext* ll, int showStatistics)
+{
+    Frame frame;
+
+    if (ll->current_role == LlTx) {
+
+        // everything still in the window has to be acknowledged first
+        if (flush_sends(ll) < 0) return -1;
+
+        while (frames_in_flight(ll) > 0) {
+            if (wait_response(ll) < 0) return -1;
         }
-        case BCC1_OK: {
-            if (info_frame == FLAG) info_state = INFO_FLAG_RCV;
-            else {
-                last_char = info_frame;
-                info_state = READ_DATA;
+
+        unsigned char block[5];
+        command_block_create(block, DISC_C);
+
+        write_block(ll, block, 5);
+        
+        printf("\nSent DISC block, waiting for response...\n");
+
+        int tries = 0;
+        
+        while (true) {
+
+            if (!read_frame(ll, &frame)) {
+
+                if (tries >= ll->current_retries) {
+                    fprintf(stderr, "Failed to receive DISC message, connection timed out...\n");
+                    return -1;
+                }
+
+                printf("Failed to read DISC frame on llclose(), retrying...\n");
+                tries++;
+                write_block(ll, block, 5);
+                continue;
+
             }
-            break;
+
+            if (frame.control == DISC_C) break;
+
         }
-        case READ_DATA: {
-            if (info_frame == ESCAPE_FLAG) {
-                info_state = EXPECT_BSTUFF;
-                insert_array(buffer, last_char);
-                last_char = info_frame;
+        
+        fprintf(stdout, "Got back DISC block, sending UA, file transfer successful!\n\n");
+        command_block_create(block, UA_C);
+        write_block(ll, block, 5);
+
+        if (showStatistics) {
+            printf("Packets sent: %d\n", ll->packets_sent);
+            printf("Retransmitted frames: %d\n", ll->retransmissions);
+            printf("I-frame writev() calls: %ld\n", ll->frame_writes);
+            printf("Rejects received: %d\n", ll->rejects_received);
+            printf("Selective rejects received: %d\n", ll->selective_rejects_received);
+            if (ll->link_params.aggregate) {
+                printf("Aggregated frames: %ld carrying %ld packets\n", ll->aggregated_frames, ll->aggregated_packets);
             }
-            else if (info_frame == FLAG) {
-                received_correct_message = true;
-                info_state = INFO_STOP;    
+            if (ll->link_params.mask) {
+                printf("Masked frames: %ld, %ld stuffed bytes saved\n", ll->masked_frames, ll->mask_saved);
             }
-            else {
-                insert_array(buffer, last_char);
-                last_char = info_frame;
+            printf("ARQ: %s, window %d\n", arq_name(ll->link_params.arq), ll->link_params.window);
+            printf("Frame check: %s\n", fcs_name(ll->link_params.fcs));
+            printf("Frame payload: %d bytes\n", ll->link_params.max_payload);
+            printf("FEC: %s\n", fec_name(ll->link_params.fec));
+            printf("Retransmission timeouts: %d\n", ll->timeouts);
+            printf("RTT samples: %d, SRTT %.1f ms, RTTVAR %.1f ms\n", ll->rtt_samples, ll->srtt, ll->rttvar);
+            printf("RTO: %.1f ms (min %.1f ms, max %.1f ms)\n", ll->rto, ll->rto_min_seen, ll->rto_max_seen);
+            print_mode_statistics(ll);
+            print_reader_statistics(ll);
+        }
+
+        return 0;
+
+    } else {
+
+        int tries = 0;
+
+        while (true) {
+
+            if (!read_frame(ll, &frame)) {
+
+                if (tries >= ll->current_retries) {
+                    fprintf(stderr, "Failed to receive any DISC block after trying to close connection...\n");
+                    return -1;
+                }
+
+                printf("Failed to read DISC frame on llclose(), retrying...\n");
+                tries++;
+                continue;
+
             }
-            break;
+
+            if (frame.control == DISC_C) break;
+
+            // everything was delivered, so this is a repeat after a lost RR
+            if (frame.control == WRITE_C) send_response(ll, RR_C, ll->rx_expected);
+
         }
-        case EXPECT_BSTUFF: {
-            unsigned char dstuff = bdestuff(info_frame);
-            if (dstuff == 0) {
-                insert_array(buffer, last_char);
-                last_char = info_frame;
-                break;
+
+        unsigned char block[5];
+        command_block_create(block, DISC_C);
+
+        fprintf(stdout, "Sending DISC and awaiting UA response\n");
+        write_block(ll, block, 5);
+        tries = 0;
+
+        while (true) {
+
+            if (!read_frame(ll, &frame)) {
+
+                if (tries >= ll->current_retries) {
+                    fprintf(stderr, "Failed to receive UA response on closing...\n");
+                    return -1;
+                }
+
+                printf("Failed to read UA frame on llclose(), retrying...\n");
+                tries++;
+                continue;
+
             }
 
-            last_char = dstuff;
-            info_state = READ_DATA;
+            if (frame.control == UA_C) break;
+
+            // our DISC got lost
+            if (frame.control == DISC_C) write_block(ll, block, 5);
+
+        }
+
+        fprintf(stdout, "Received UA response from transmitter, file transfer successful!\n\n");
+        if (showStatistics) {
+            printf("Packets read: %d\n", ll->packets_read);
+            if (ll->link_params.aggregate) {
+                printf("Aggregated frames: %ld carrying %ld packets\n", ll->aggregated_frames, ll->aggregated_packets);
+            }
+            printf("Acknowledgements: %ld RR frames, every %d frames or after %d ms\n", ll->acks_sent, ack_every(ll), ACK_DELAY_MS);
+            printf("Frame check: %s\n", fcs_name(ll->link_params.fcs));
+            printf("Frame payload: %d bytes\n", ll->link_params.max_payload);
+            printf("FEC: %s\n", fec_name(ll->link_params.fec));
+            if (ll->fec_limit > 0) {
+                printf("FEC corrected %ld bytes in %ld frames, %ld frames beyond repair\n", ll->fec_corrected, ll->fec_frames, ll->fec_failures);
+            }
+            print_mode_statistics(ll);
+            print_reader_statistics(ll);
         }
-        case INFO_STOP: break;
+
+        return 0;
 
     }
+}
+
+
+////////////////////////////////////////////////
+// UTILITY FUNCTIONS
+////////////////////////////////////////////////
 
+// One try of the handshakes, a whole timeout without a valid frame fails it
+static int read_frame(LinkContext* ll, Frame* frame) {
+    return read_frame_until(ll, frame, now_ms() + ll->current_timeout * 1000.0);
 }
 
-void llclosetx_state_machine(unsigned char super_frame) {
-    
-   switch (super_state) {
-        case START: {
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            break;
-        }
-        case FLAG_RCV: {
-            if (super_frame == SET_A) super_state = A_RCV;
-            else if (super_frame != FLAG) super_state = START;
-            break;
+// Acts on a frame that is not a response to our own, and copies it to packet
+// if it is the next one in order. Returns its size then, 0 otherwise.
+static int receive_frame(LinkContext* ll, Frame* frame, unsigned char* packet) {
+
+    if (frame->control == SET_C) {
+        // our UA got lost, the transmitter is still on llopen()
+        unsigned char receiver_block[5];
+        receiver_block_create(receiver_block);
+        write_block(ll, receiver_block, 5);
+        return 0;
+    }
+
+    if (frame->control == XID_C) {
+        if (frame->valid_data) answer_xid(ll, frame);
+        return 0;
+    }
+
+    if (frame->control == MODE_C) {
+        answer_mode(ll, frame);
+        return 0;
+    }
+
+    if (frame->control != WRITE_C) return 0;
+
+    if (frame->extended != (ll->link_params.arq != ARQ_STOP_AND_WAIT)) {
+
+        if (frame->extended) return 0;
+
+        // the transmitter never got our XID answer and stayed on stop-and-wait
+        printf("Peer kept legacy framing, falling back to stop-and-wait\n");
+        ll->link_params.arq = ARQ_STOP_AND_WAIT;
+        ll->link_params.window = 1;
+        ll->link_params.modulus = LEGACY_MODULUS;
+        ll->link_params.fcs = FCS_XOR;
+        ll->link_params.max_payload = LEGACY_MAX_PAYLOAD;
+        ll->link_params.fec = 0;
+        ll->link_params.adaptive = false;
+        ll->link_params.aggregate = false;
+        ll->link_params.mask = false;
+        ll->link_params.compress = COMPRESS_NONE;
+        ll->reader.fcs = FCS_XOR;
+        ll->rx_expected = 0;
+        ll->rx_deliver = 0;
+        setup_pools(ll);
+
+    }
+
+    int ahead = (frame->seq - ll->rx_expected + ll->link_params.modulus) % ll->link_params.modulus;
+    bool valid = frame->valid_data && frame->size <= ll->link_params.max_payload && (!frame->aggregated || batch_well_formed(frame->data, frame->size));
+    bool selective = (ll->link_params.arq == ARQ_SELECTIVE_REPEAT);
+
+    // with nowhere to put it, or stored frames to hand over first, the frame
+    // waits in the receive window, and unacknowledged once that is full
+    bool keep = (packet == NULL || ll->rx_deliver != ll->rx_expected);
+    if (ahead == 0 && valid && keep && !store_frame(ll, frame)) return 0;
+
+    if (ahead == 0 && valid) {
+
+        int size = 0;
+
+        // a kept frame is handed over from ll->rx_deliver later
+        if (!keep && frame->aggregated) {
+            load_batch(ll, frame->data, frame->size);
+            size = deliver_batched(ll, packet);
+        } else if (!keep) {
+            size = frame->size;
+            memcpy(packet, frame->data, frame->size);
+            ll->payload_bytes += frame->size;
+            ll->packets_read++;
         }
-        case A_RCV: {
-            if (super_frame == DISC_C) super_state = C_RCV;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
+
+        ll->rx_expected = (ll->rx_expected + 1) % ll->link_params.modulus;
+        if (!keep) ll->rx_deliver = ll->rx_expected;
+        ll->srej_sent[frame->seq] = false;
+        ll->reject_sent = false;
+
+        // buffered frames right after this one are acknowledged along with
+        // it, and at once, the peer is waiting to hear the gap is closed
+        bool filled = false;
+        while (selective && ll->rx_stored[ll->rx_expected]) {
+            ll->rx_expected = (ll->rx_expected + 1) % ll->link_params.modulus;
+            filled = true;
         }
-        case C_RCV: {
-            if (super_frame == (SET_A ^ DISC_C)) super_state = BCC_OK;
-            else if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
+
+        acknowledge(ll, filled);
+
+        return size;
+
+    }
+
+    if (selective && ahead < ll->link_params.window) {
+
+        if (valid && !ll->rx_stored[frame->seq]) {
+            store_frame(ll, frame);
+        } else if (!valid) {
+            // the header survived, so ask for exactly this frame again
+            send_response(ll, SREJ_C, frame->seq);
+            ll->srej_sent[frame->seq] = true;
         }
-        case BCC_OK: {
-            if (super_frame == FLAG) {
-                received_correct_message = true;
-                super_state = STOP;
+
+        // every frame missing before this one is asked for once
+        for (int i = ll->rx_expected; i != frame->seq; i = (i + 1) % ll->link_params.modulus) {
+            if (!ll->rx_stored[i] && !ll->srej_sent[i]) {
+                send_response(ll, SREJ_C, i);
+                ll->srej_sent[i] = true;
             }
-            else super_state = START;
-            break;
-        }
-        case STOP: {
-            break;
         }
+
+    } else if (ahead == 0 || (ahead < ll->link_params.window && !ll->reject_sent)) {
+
+        // corrupted or out of order, everything from ll->rx_expected on has to come again
+        send_response(ll, REJ_C, ll->rx_expected);
+        ll->reject_sent = true;
+
+    } else if (ahead >= ll->link_params.modulus - ll->link_params.window) {
+
+        // already delivered, our RR must have been lost
+        send_response(ll, RR_C, ll->rx_expected);
+
     }
 
+    return 0;
+
 }
 
-void llcloserx_state_machine(unsigned char super_frame) {
+// Keeps a frame in the receive window until it is handed over, false when
+// every buffer is taken
+static bool store_frame(LinkContext* ll, Frame* frame) {
 
-    switch (super_state) {
-        case START: {
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            break;
-        }
-        case FLAG_RCV: {
-            if (super_frame == SET_A) super_state = A_RCV;
-            else if (super_frame != FLAG) super_state = START;
-            break;
-        }
-        case A_RCV: {
-            if (reading_closing_UA) {
-                if (super_frame == UA_C) super_state = C_RCV;
-                break;
-            } else {
-                if (super_frame == DISC_C) super_state = C_RCV;
-                break;
-            }
+    if (!pool_take(&ll->rx_pool, &ll->rx_window[frame->seq])) return false;
 
-            if (super_frame == FLAG) super_frame = FLAG_RCV;
-            else super_state = START;
-            break;
+    memcpy(ll->rx_window[frame->seq].array, frame->data, frame->size);
+    ll->rx_window[frame->seq].used = frame->size;
+    ll->rx_stored[frame->seq] = true;
+    ll->rx_aggregated[frame->seq] = frame->aggregated;
+    ll->srej_sent[frame->seq] = false;
+    return true;
+
+}
+
+static int frames_in_flight(LinkContext* ll) {
+    return (ll->tx_next - ll->tx_base + ll->link_params.modulus) % ll->link_params.modulus;
+}
+
+// Next frame the reader has whole. Coded frames are repaired first and
+// their BCC and FCS worked out over what the repair left.
+static bool next_frame(LinkContext* ll, Frame* frame) {
+
+    while (reader_next_frame(&ll->reader, &ll->rx_frame)) {
+
+        unsigned char bcc = ll->reader.bcc;
+        uint32_t crc = ll->reader.crc;
+        FcsMode fcs = ll->link_params.fcs;
+
+        if (ll->link_params.fec > 0 && ll->rx_frame.used > SUPERVISORY_MAX) {
+            fec_decode(ll, &ll->rx_frame);
+            bcc = fcs_update(FCS_XOR, 0, ll->rx_frame.array, ll->rx_frame.used);
+            crc = fcs_update(fcs, fcs_init(fcs), ll->rx_frame.array, ll->rx_frame.used);
         }
-        case C_RCV: {
 
-            if (reading_closing_UA) {
-                if (super_frame == (SET_A ^ UA_C)) super_state = BCC_OK;
-                break;
-            } else {
-                if (super_frame == (SET_A ^ DISC_C)) super_state = BCC_OK;
-                break;
-            }
-            if (super_frame == FLAG) super_state = FLAG_RCV;
-            else super_state = START;
-            break;
+        if (parse_frame(&ll->rx_frame, bcc, crc, fcs, frame) == 0) {
+
+            // the FCS covers masked data as it was sent
+            if (frame->mask != 0 && frame->valid_data) xor_mask(frame->data, frame->data, frame->size, frame->mask);
+            return true;
+
         }
-        case BCC_OK: {
-            if (super_frame == FLAG) {
-                received_correct_message = true;
-                super_state = STOP;
-                reading_closing_UA = true;
-            }
-            else super_state = START;
+
+    }
+
+    return false;
+
+}
+
+// Corrects each codeword of a frame in place and drops their parity
+static void fec_decode(LinkContext* ll, Array* frame) {
+
+    size_t parity = ll->link_params.fec;
+    size_t used = 0;
+    int corrected = 0;
+    bool failed = false;
+
+    for (size_t i = 0; i < frame->used; i += RS_BLOCK) {
+
+        size_t size = (frame->used - i < RS_BLOCK) ? frame->used - i : RS_BLOCK;
+        if (size <= parity) {
+            failed = true;
             break;
         }
-        case STOP: {
-            break;
+
+        int fixed = rs_decode(frame->array + i, size, parity);
+        if (fixed < 0) {
+            failed = true;
+        } else {
+            corrected += fixed;
         }
+
+        memmove(frame->array + used, frame->array + i, size - parity);
+        used += size - parity;
+
+    }
+
+    frame->used = used;
+
+    // one that could not be repaired fails its FCS and is asked for again
+    if (failed) {
+        ll->fec_failures++;
+    } else if (corrected > 0) {
+        ll->fec_frames++;
+        ll->fec_corrected += corrected;
+        ll->rx_repaired = true;
     }
 
-}
\ No newline at end of file
+}
+
+// Coded frames are checked once repaired, so the reader only keeps the BCC
+static FcsMode reader_fcs(const LinkParams* params) {
+    return params->fec > 0 ? FCS_XOR : params->fcs;
+}
+
+static int read_frame_until(LinkContext* ll, Frame* frame, double deadline) {
+
+    while (true) {
+
+        if (next_frame(ll, frame)) return 1;
+
+        if (ll->acks_pending > 0 && now_ms() >= ll->ack_deadline) flush_ack(ll);
+
+        int bytes = reader_fill(&ll->reader, ll->current_fd);
+        if (bytes > 0) continue;
+        if (bytes < 0 && errno != EAGAIN && errno != EINTR) return 0;
+
+        // a delayed acknowledgement may fall due first
+        if (ll->acks_pending > 0 && ll->ack_deadline < deadline) {
+            wait_port(ll, EPOLLIN, ll->ack_deadline);
+            continue;
+        }
+
+        if (!wait_port(ll, EPOLLIN, deadline)) return 0;
+
+    }
+
+}
+
+// Waits until the port is ready for events or deadline, on the now_ms()
+// clock, passes. Returns 1 when the port is ready and 0 on the deadline,
+// which is also what a hung up port gets once the deadline is up.
+static int wait_port(LinkContext* ll, uint32_t events, double deadline) {
+
+    if (events != ll->port_events) {
+        struct epoll_event port = { .events = events, .data.fd = ll->current_fd };
+        epoll_ctl(ll->epoll_fd, EPOLL_CTL_MOD, ll->current_fd, &port);
+        ll->port_events = events;
+    }
+
+    // the timer runs on the same clock as now_ms(), so the deadline is set as
+    // it is; setting it also clears expirations left from an earlier wait
+    bool expired = deadline <= now_ms();
+    struct itimerspec timer = { { 0, 0 }, { 0, 0 } };
+
+    if (!expired) {
+        timer.it_value.tv_sec = (time_t) (deadline / 1000);
+        timer.it_value.tv_nsec = (long) ((deadline - timer.it_value.tv_sec * 1000.0) * 1e6);
+        if (timer.it_value.tv_nsec >= 1000000000L) timer.it_value.tv_nsec = 999999999L;
+    }
+
+    timerfd_settime(ll->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+    struct epoll_event ready[2];
+    int count;
+
+    do {
+        count = epoll_wait(ll->epoll_fd, ready, 2, expired ? 0 : -1);
+    } while (count < 0 && errno == EINTR);
+
+    bool hangup = false;
+    for (int i = 0; i < count; i++) {
+        if (ready[i].data.fd != ll->current_fd) continue;
+        if (!(ready[i].events & (EPOLLHUP | EPOLLERR))) return 1;
+        hangup = true;
+    }
+
+    // a hung up port stays ready for good, reads come back empty and writes
+    // fail, so only the timer is left to wait on
+    if (hangup && !expired) {
+        struct pollfd timer_ready = { .fd = ll->timer_fd, .events = POLLIN };
+        while (poll(&timer_ready, 1, -1) < 0 && errno == EINTR);
+    }
+
+    return 0;
+
+}
+
+// Puts all of iov on the port, waiting for room while the driver's output
+// buffer is full. Gives up after a whole timeout without progress.
+static int write_port(LinkContext* ll, struct iovec* iov, int count) {
+
+    long written = 0;
+    double deadline = now_ms() + ll->current_timeout * 1000.0;
+
+    while (count > 0) {
+
+        ssize_t bytes = writev(ll->current_fd, iov, count);
+
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || !wait_port(ll, EPOLLOUT, deadline)) return -1;
+            continue;
+        }
+
+        written += bytes;
+        deadline = now_ms() + ll->current_timeout * 1000.0;
+
+        while (count > 0 && (size_t) bytes >= iov->iov_len) {
+            bytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (unsigned char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+
+    }
+
+    return written;
+
+}
+
+static int write_block(LinkContext* ll, const unsigned char* block, int size) {
+
+    struct iovec iov = { (void *) block, size };
+    return write_port(ll, &iov, 1);
+
+}
+
+double now_ms() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+
+}
+
+static int send_frames(LinkContext* ll, int seq, int count) {
+
+    // frames are kept fully framed, so a run of them goes out in one writev()
+    struct iovec iov[EXT_MODULUS];
+    long total = 0;
+
+    for (int i = 0; i < count; i++) {
+        Array* frame = &ll->tx_window[(seq + i) % ll->link_params.modulus];
+        iov[i].iov_base = frame->array;
+        iov[i].iov_len = frame->used;
+        total += frame->used;
+    }
+
+    int written_bytes = write_port(ll, iov, count);
+    ll->frame_writes++;
+
+    // a frame only starts its round trip once everything queued ahead of it went out
+    int queued = 0;
+    if (ioctl(ll->current_fd, TIOCOUTQ, &queued) < 0) queued = total;
+
+    double now = now_ms();
+    long behind = total;
+
+    for (int i = 0; i < count; i++) {
+
+        int n = (seq + i) % ll->link_params.modulus;
+        behind -= ll->tx_window[n].used;
+
+        long ahead = queued - behind;
+        if (ahead < 0) ahead = 0;
+
+        ll->tx_sent_at[n] = now;
+        ll->tx_queued[n] = ahead * 10000.0 / ll->current_baudrate;
+        ll->tx_deadline[n] = now + ll->tx_queued[n] + ll->rto;
+
+    }
+
+    return written_bytes;
+
+}
+
+static bool still_queued(LinkContext* ll, int seq) {
+
+    int queued = 0;
+    if (ioctl(ll->current_fd, TIOCOUTQ, &queued) < 0) return false;
+
+    long behind = 0;
+    for (int i = (seq + 1) % ll->link_params.modulus; i != ll->tx_next; i = (i + 1) % ll->link_params.modulus) {
+        behind += ll->tx_window[i].used;
+    }
+
+    return queued > behind;
+
+}
+
+static void retransmit_from(LinkContext* ll, int seq) {
+
+    int count = (ll->tx_next - seq + ll->link_params.modulus) % ll->link_params.modulus;
+    if (count == 0) return;
+
+    send_frames(ll, seq, count);
+
+    for (int i = seq; i != ll->tx_next; i = (i + 1) % ll->link_params.modulus) {
+        ll->tx_resent[i] = true;
+        ll->retransmissions++;
+    }
+
+}
+
+static void update_rto(LinkContext* ll, double sample) {
+
+    // RFC 6298
+    if (ll->rtt_samples == 0) {
+        ll->srtt = sample;
+        ll->rttvar = sample / 2;
+    } else {
+        double error = ll->srtt > sample ? ll->srtt - sample : sample - ll->srtt;
+        ll->rttvar = 0.75 * ll->rttvar + 0.25 * error;
+        ll->srtt = 0.875 * ll->srtt + 0.125 * sample;
+    }
+
+    ll->rtt_samples++;
+    set_rto(ll, ll->srtt + 4 * ll->rttvar);
+
+}
+
+static void set_rto(LinkContext* ll, double value) {
+
+    double ceiling = ll->current_timeout * 1000.0;
+
+    if (value < RTO_MIN_MS) value = RTO_MIN_MS;
+    if (value > ceiling) value = ceiling;
+    ll->rto = value;
+
+    if (ll->rto < ll->rto_min_seen) ll->rto_min_seen = ll->rto;
+    if (ll->rto > ll->rto_max_seen) ll->rto_max_seen = ll->rto;
+
+}
+
+static int wait_response(LinkContext* ll) {
+
+    Frame frame;
+    int result;
+
+    if (!read_frame_until(ll, &frame, ll->tx_deadline[ll->tx_base])) {
+        result = response_timeout(ll);
+    } else {
+        result = handle_response(ll, &frame);
+    }
+
+    // the frames stuck in the window may be exactly what needs the new mode
+    return result < 0 ? -1 : switch_mode(ll);
+
+}
+
+// The oldest frame's retransmission timer ran out
+static int response_timeout(LinkContext* ll) {
+
+    // the timer only runs once the frame actually left the output queue
+    if (still_queued(ll, ll->tx_base)) {
+        ll->tx_deadline[ll->tx_base] = now_ms() + ll->rto;
+        return 0;
+    }
+
+    // a frame that was only late says nothing about the line, it is judged
+    // once it is rejected or acknowledged
+    ll->tx_timed_out[ll->tx_base] = true;
+
+    // backing off up to the ceiling is free, only tries at the ceiling count,
+    // unless the monitor just picked a mode that may get through
+    if (ll->rto >= ll->current_timeout * 1000.0) {
+
+        if (ll->tx_tries >= ll->current_retries && !mode_pending(ll)) {
+            fprintf(stderr, "Lost connection, not getting response from receiver...\n");
+            return -1;
+        }
+
+        printf("Failed to read response frame on llwrite(), retrying...\n");
+        ll->tx_tries++;
+
+    }
+
+    ll->timeouts++;
+    set_rto(ll, ll->rto * 2);
+
+    // selective repeat keeps what arrived, the oldest frame is the one missing
+    if (ll->link_params.arq == ARQ_SELECTIVE_REPEAT) {
+        send_frames(ll, ll->tx_base, 1);
+        ll->tx_resent[ll->tx_base] = true;
+        ll->retransmissions++;
+    } else {
+        retransmit_from(ll, ll->tx_base);
+    }
+    return 0;
+
+}
+
+static int handle_response(LinkContext* ll, Frame* frame) {
+
+    if (frame->control != RR_C && frame->control != REJ_C && frame->control != SREJ_C) {
+
+        // the peer may be answering already, its frames wait for llread()
+        int expected = ll->rx_expected;
+        receive_frame(ll, frame, NULL);
+
+        // it sends its RR before anything new, so with ours still unanswered
+        // that RR was lost; the oldest frame goes again rather than wait out
+        // a timer that may have no round trip to go on yet
+        if (ll->rx_expected != expected && frames_in_flight(ll) > 0 && !ll->tx_resent[ll->tx_base]) {
+            send_frames(ll, ll->tx_base, 1);
+            ll->tx_resent[ll->tx_base] = true;
+            ll->retransmissions++;
+        }
+        return 0;
+
+    }
+
+    if (frame->control == SREJ_C) {
+
+        // only the named frame is sent again, it acknowledges nothing
+        int offset = (frame->seq - ll->tx_base + ll->link_params.modulus) % ll->link_params.modulus;
+        if (offset < frames_in_flight(ll)) {
+            send_frames(ll, frame->seq, 1);
+            ll->tx_resent[frame->seq] = true;
+            note_quality(ll, true);
+            settle_timeout(ll, frame->seq, true);
+            ll->retransmissions++;
+            ll->selective_rejects_received++;
+        }
+        return 0;
+
+    }
+
+    if (frame->control != RR_C && frame->control != REJ_C) return 0;
+
+    // N(R) acknowledges every frame before it
+    int acked = (frame->seq - ll->tx_base + ll->link_params.modulus) % ll->link_params.modulus;
+    if (acked > frames_in_flight(ll)) return 0;
+
+    if (acked > 0) {
+
+        // the oldest frame acknowledged times the round trip, its timer is the
+        // one that runs, and it waited out the receiver's delayed RR with the
+        // rest; unless a retransmission in between may be what got it acknowledged
+        bool ambiguous = false;
+        for (int i = ll->tx_base; i != frame->seq; i = (i + 1) % ll->link_params.modulus) {
+            if (ll->tx_resent[i]) ambiguous = true;
+        }
+
+        if (!ambiguous) {
+            double sample = now_ms() - ll->tx_sent_at[ll->tx_base] - ll->tx_queued[ll->tx_base];
+            update_rto(ll, sample > 0 ? sample : 0);
+        }
+
+        for (int i = ll->tx_base; i != frame->seq; i = (i + 1) % ll->link_params.modulus) {
+            settle_timeout(ll, i, frame->repaired);
+            note_quality(ll, false);
+            pool_give(&ll->tx_pool, &ll->tx_window[i]);
+            for (int k = 0; k < ll->tx_notify[i]; k++) {
+                LinkCompletion* sent = &ll->sent[ll->sent_head];
+                complete(ll, LINK_SENT, sent->user, sent->size);
+                ll->sent_head = (ll->sent_head + 1) % LINK_COMPLETIONS;
+                ll->sent_count--;
+                ll->async_sends--;
+            }
+            ll->tx_notify[i] = 0;
+        }
+
+        ll->tx_base = frame->seq;
+        ll->tx_tries = 0;
+
+        // repairs are no reason for more protection, but the FEC doing them
+        // is not dropped either
+        if (frame->repaired) ll->clean_run = 0;
+
+    }
+
+    if (frame->control == REJ_C) {
+
+        ll->rejects_received++;
+        note_quality(ll, true);
+        settle_timeout(ll, ll->tx_base, true);
+
+        // unless the monitor just picked a mode that may get through
+        if (ll->tx_tries >= ll->current_retries && !mode_pending(ll)) {
+            fprintf(stderr, "Received %d rejects in a row, leaving...\n", ll->tx_tries);
+            return -1;
+        }
+
+        ll->tx_tries++;
+        retransmit_from(ll, ll->tx_base);
+
+    }
+
+    return 0;
+
+}
+
+// One outcome for the quality monitor: a frame acknowledged, or a reject
+// or a confirmed timeout against one
+static void note_quality(LinkContext* ll, bool blamed) {
+
+    if (!ll->link_params.adaptive) return;
+
+    ll->quality = (ll->quality << 1) | blamed;
+    ll->clean_run = blamed ? 0 : ll->clean_run + 1;
+
+    judge_quality(ll);
+
+}
+
+// Settles a frame's timeout once its fate is known: damaged, when it was
+// rejected or needed repairs, counts against the line, late does not
+static void settle_timeout(LinkContext* ll, int seq, bool damaged) {
+
+    if (!ll->tx_timed_out[seq]) return;
+
+    ll->tx_timed_out[seq] = false;
+    if (damaged) note_quality(ll, true);
+
+}
+
+// Picks the mode for the frames to come from the last QUALITY_WINDOW
+// outcomes. Errors first get stronger FEC, which keeps frames long, and
+// shorter frames only once it is at its strongest; a clean line gets them
+// back in the opposite order.
+static void judge_quality(LinkContext* ll) {
+
+    int blamed = __builtin_popcountll(ll->quality);
+    int fec = ll->link_params.fec;
+    int payload = ll->payload;
+
+    if (blamed >= QUALITY_BAD) {
+
+        if (fec < ll->fec_limit) {
+            fec = (fec == 0) ? QUALITY_FEC_STEP : 2 * fec;
+            if (fec > ll->fec_limit) fec = ll->fec_limit;
+        } else if (payload > LEGACY_MAX_PAYLOAD) {
+            payload /= 2;
+            if (payload < LEGACY_MAX_PAYLOAD) payload = LEGACY_MAX_PAYLOAD;
+        }
+
+    } else if (ll->clean_run >= QUALITY_CLEAN) {
+
+        if (payload < ll->link_params.max_payload) {
+            payload *= 2;
+            if (payload > ll->link_params.max_payload) payload = ll->link_params.max_payload;
+        } else if (fec > 0) {
+            fec = (fec / 2) & ~1;
+            if (fec < QUALITY_FEC_STEP) fec = 0;
+        }
+
+    }
+
+    ll->mode_fec = fec;
+    ll->mode_payload = payload;
+    ll->mode_blamed = blamed;
+
+}
+
+// Moves both ends to the mode the monitor picked, if it differs. Nothing
+// else goes out until the peer echoes the MODE frame: the port keeps order,
+// so every frame sent before it arrives coded the old way, and the ones
+// still unacknowledged are coded again the new way before any repeat.
+static int switch_mode(LinkContext* ll) {
+
+    int fec = ll->mode_fec;
+    int payload = ll->mode_payload;
+
+    if (fec == ll->link_params.fec && payload == ll->payload) return 0;
+
+    Array mode;
+    init_array(&mode, 16);
+    mode_frame_create(&mode, fec, payload);
+    write_block(ll, mode.array, mode.used);
+
+    int tries = 0;
+    Frame frame;
+    int echo_fec;
+    int echo_payload;
+
+    while (true) {
+
+        if (!read_frame(ll, &frame)) {
+
+            if (tries >= ll->current_retries) {
+                fprintf(stderr, "Failed to receive MODE answer, connection timed out...\n");
+                free_array(&mode);
+                return -1;
+            }
+
+            printf("Failed to read MODE answer, retrying...\n");
+            tries++;
+            write_block(ll, mode.array, mode.used);
+            continue;
+
+        }
+
+        if (frame.control == MODE_C && parse_mode(&frame, &echo_fec, &echo_payload) == 0 && echo_fec == fec && echo_payload == payload) break;
+
+        // acknowledgements still count, anything that would send waits for the timers
+        if (frame.control == RR_C && handle_response(ll, &frame) < 0) {
+            free_array(&mode);
+            return -1;
+        }
+
+    }
+
+    free_array(&mode);
+
+    // the frames in the window get a fresh set of tries in the new mode
+    int from = ll->link_params.fec;
+    apply_mode(ll, fec, payload, ll->mode_blamed);
+    ll->tx_tries = 0;
+
+    if (fec != from) {
+        for (int i = ll->tx_base; i != ll->tx_next; i = (i + 1) % ll->link_params.modulus) {
+            if (recode_frame(ll, i, ll->tx_window[i].array, ll->tx_window[i].used, from, &ll->tx_window[i]) < 0) return -1;
+        }
+    }
+
+    return 0;
+
+}
+
+static bool mode_pending(LinkContext* ll) {
+    return ll->mode_fec != ll->link_params.fec || ll->mode_payload != ll->payload;
+}
+
+// The peer's monitor asks for a new mode, taken as long as the buffers were
+// sized for it. A repeat of the current one is echoed again all the same,
+// our first answer may have been lost.
+static void answer_mode(LinkContext* ll, Frame* frame) {
+
+    int fec;
+    int payload;
+
+    if (!ll->link_params.adaptive || parse_mode(frame, &fec, &payload) < 0) return;
+    if (fec > ll->fec_limit || (fec & 1) || (fec > 0 && fec < FEC_MIN_PARITY)) return;
+    if (payload < LEGACY_MAX_PAYLOAD || payload > ll->link_params.max_payload) return;
+
+    apply_mode(ll, fec, payload, -1);
+
+    Array mode;
+    init_array(&mode, 16);
+    mode_frame_create(&mode, fec, payload);
+    write_block(ll, mode.array, mode.used);
+    free_array(&mode);
+
+}
+
+static void apply_mode(LinkContext* ll, int fec, int payload, int blamed) {
+
+    if (fec == ll->link_params.fec && payload == ll->payload) return;
+
+    if (ll->mode_changes < MODE_LOG) {
+        ModeChange* change = &ll->mode_log[ll->mode_changes];
+        change->packet = ll->packets_sent + ll->packets_read;
+        change->blamed = blamed;
+        change->srtt = ll->srtt;
+        change->payload = payload;
+        change->fec = fec;
+    }
+    ll->mode_changes++;
+
+    // a framer thread reads both while building frames ahead
+    __atomic_store_n(&ll->link_params.fec, fec, __ATOMIC_RELAXED);
+    __atomic_store_n(&ll->payload, payload, __ATOMIC_RELAXED);
+    ll->mode_fec = fec;
+    ll->mode_payload = payload;
+    ll->reader.fcs = reader_fcs(&ll->link_params);
+
+    // the new mode is judged on frames of its own
+    ll->quality = 0;
+    ll->clean_run = 0;
+
+}
+
+int llmaxpayload() {
+    return link_maxpayload(default_link);
+}
+
+int link_maxpayload(LinkContext* ll) {
+    return ll->link_params.max_payload;
+}
+
+int link_payload(LinkContext* ll) {
+    return __atomic_load_n(&ll->payload, __ATOMIC_RELAXED);
+}
+
+static void link_free(LinkContext* ll) {
+
+    pool_free(&ll->tx_pool);
+    pool_free(&ll->rx_pool);
+    pool_free(&ll->send_pool);
+    free_array(&ll->rx_frame);
+    free(ll->recode.array);
+    free(ll->rx_batch.array);
+    reader_free(&ll->reader);
+    close(ll->timer_fd);
+    close(ll->epoll_fd);
+    close(ll->current_fd);
+    free(ll);
+
+}
+
+static void own_params(LinkContext* ll, LinkParams* params) {
+
+    params->arq = ARQ_MODE;
+    params->window = ARQ_WINDOW;
+    params->modulus = EXT_MODULUS;
+    params->fcs = FCS_MODE;
+    params->fec = FEC_PARITY;
+    params->adaptive = LINK_ADAPT;
+    params->aggregate = AGGREGATE;
+    params->mask = XOR_MASK;
+    params->compress = COMPRESS_NEWEST;
+
+    // a frame that takes longer than the timeout to go out is always retransmitted
+    long per_timeout = (long) ll->current_baudrate / 10 * ll->current_timeout / 2;
+    params->max_payload = FRAME_PAYLOAD;
+    if (PAYLOAD_CAP && params->max_payload > per_timeout) params->max_payload = per_timeout;
+
+}
+
+static void xid_exchange(LinkContext* ll) {
+
+    LinkParams own;
+    own_params(ll, &own);
+    if (own.arq == ARQ_STOP_AND_WAIT) return;
+
+    Array xid;
+    init_array(&xid, 16);
+    xid_frame_create(&xid, &own);
+    write_block(ll, xid.array, xid.used);
+    free_array(&xid);
+
+    // peers that do not answer within one timeout only speak stop-and-wait
+    Frame frame;
+    while (read_frame(ll, &frame)) {
+
+        if (frame.control != XID_C || !frame.valid_data) continue;
+
+        LinkParams peer = own;
+        parse_xid(&frame, &peer);
+        negotiate_params(&own, &peer);
+        ll->link_params = own;
+        ll->reader.fcs = reader_fcs(&ll->link_params);
+        setup_pools(ll);
+        break;
+
+    }
+
+    printf("Using %s with a window of %d frames, %s, %d byte payloads and FEC %s%s\n", arq_name(ll->link_params.arq), ll->link_params.window, fcs_name(ll->link_params.fcs), ll->link_params.max_payload, fec_name(ll->link_params.fec), ll->link_params.adaptive ? ", adapting to the line" : "");
+
+}
+
+static void send_response(LinkContext* ll, unsigned char response, int nr) {
+
+    // the peer's quality monitor hears of repairs along with the RR
+    if (response == RR_C && ll->link_params.adaptive && ll->rx_repaired) {
+        nr |= NR_REPAIRED;
+        ll->rx_repaired = false;
+    }
+
+    unsigned char block[SUPERVISORY_MAX];
+    int size = response_block_create(block, response, nr, &ll->link_params);
+    write_block(ll, block, size);
+
+    // both acknowledge everything before N(R)
+    if (response == RR_C || response == REJ_C) ll->acks_pending = 0;
+    if (response == RR_C) ll->acks_sent++;
+
+}
+
+// Counts a frame delivered in order, and sends the cumulative RR once enough
+// of them waited or right away if asked to
+static void acknowledge(LinkContext* ll, bool now) {
+
+    if (ll->acks_pending == 0) ll->ack_deadline = now_ms() + ACK_DELAY_MS;
+    ll->acks_pending++;
+
+    if (now || ll->acks_pending >= ack_every(ll)) send_response(ll, RR_C, ll->rx_expected);
+
+}
+
+static void flush_ack(LinkContext* ll) {
+
+    if (ll->acks_pending > 0) send_response(ll, RR_C, ll->rx_expected);
+
+}
+
+// frames an RR may cover, the transmitter must still have room in its window
+static int ack_every(LinkContext* ll) {
+
+    int most = ll->link_params.window / 2;
+    if (most < 1) most = 1;
+
+    return ACK_EVERY < most ? ACK_EVERY : most;
+
+}
+
+static int deliver_stored(LinkContext* ll, unsigned char* packet) {
+
+    Array* stored = &ll->rx_window[ll->rx_deliver];
+    int size = stored->used;
+    bool aggregated = ll->rx_aggregated[ll->rx_deliver];
+
+    if (aggregated) {
+        load_batch(ll, stored->array, size);
+    } else {
+        memcpy(packet, stored->array, size);
+        ll->payload_bytes += size;
+        ll->packets_read++;
+    }
+
+    pool_give(&ll->rx_pool, stored);
+    ll->rx_stored[ll->rx_deliver] = false;
+    ll->rx_deliver = (ll->rx_deliver + 1) % ll->link_params.modulus;
+
+    return aggregated ? deliver_batched(ll, packet) : size;
+
+}
+
+// The packet that comes next in order: the rest of an aggregated frame
+// first, then the frames that arrived ahead of a gap
+static int deliver_next(LinkContext* ll, unsigned char* packet) {
+    return batch_pending(ll) ? deliver_batched(ll, packet) : deliver_stored(ll, packet);
+}
+
+static int deliver_batched(LinkContext* ll, unsigned char* packet) {
+
+    unsigned char* at = ll->rx_batch.array + ll->rx_batch_pos;
+    int size = (at[0] << 8) | at[1];
+
+    memcpy(packet, at + SUBPACKET_HEADER_SIZE, size);
+    ll->rx_batch_pos += SUBPACKET_HEADER_SIZE + size;
+    ll->payload_bytes += size;
+    ll->packets_read++;
+    ll->aggregated_packets++;
+
+    return size;
+
+}
+
+static bool batch_pending(LinkContext* ll) {
+    return ll->rx_batch_pos < ll->rx_batch.used;
+}
+
+// Whether the lengths in an aggregated frame add up to exactly its size
+static bool batch_well_formed(const unsigned char* data, int size) {
+
+    int pos = 0;
+
+    while (pos + SUBPACKET_HEADER_SIZE <= size) {
+        int length = (data[pos] << 8) | data[pos + 1];
+        if (length == 0) return false;
+        pos += SUBPACKET_HEADER_SIZE + length;
+    }
+
+    return pos == size && size > 0;
+
+}
+
+static void load_batch(LinkContext* ll, const unsigned char* data, int size) {
+
+    memcpy(ll->rx_batch.array, data, size);
+    ll->rx_batch.used = size;
+    ll->rx_batch_pos = 0;
+    ll->aggregated_frames++;
+
+}
+
+static void answer_xid(LinkContext* ll, Frame* frame) {
+
+    LinkParams own;
+    own_params(ll, &own);
+    LinkParams peer = own;
+
+    parse_xid(frame, &peer);
+    negotiate_params(&own, &peer);
+    ll->link_params = own;
+    ll->reader.fcs = reader_fcs(&ll->link_params);
+    ll->rx_expected = 0;
+    ll->rx_deliver = 0;
+    setup_pools(ll);
+
+    Array xid;
+    init_array(&xid, 16);
+    xid_frame_create(&xid, &ll->link_params);
+    write_block(ll, xid.array, xid.used);
+    free_array(&xid);
+
+    printf("Peer asked for XID, using %s with a window of %d frames, %s, %d byte payloads and FEC %s%s\n", arq_name(ll->link_params.arq), ll->link_params.window, fcs_name(ll->link_params.fcs), ll->link_params.max_payload, fec_name(ll->link_params.fec), ll->link_params.adaptive ? ", adapting to the line" : "");
+
+}
+
+static void setup_pools(LinkContext* ll) {
+
+    // only runs while nothing is in flight or waiting, so no frame holds a buffer
+    for (int i = 0; i < EXT_MODULUS; i++) {
+        ll->tx_window[i].array = NULL;
+        ll->rx_window[i].array = NULL;
+        ll->rx_stored[i] = false;
+        ll->rx_aggregated[i] = false;
+        ll->srej_sent[i] = false;
+    }
+    pool_free(&ll->tx_pool);
+    pool_free(&ll->rx_pool);
+    pool_free(&ll->send_pool);
+
+    // the monitor starts from what was negotiated and may go as far as
+    // RS_MAX_PARITY, so everything is sized for that
+    ll->fec_limit = ll->link_params.adaptive ? RS_MAX_PARITY : ll->link_params.fec;
+    ll->payload = ll->link_params.max_payload;
+    ll->mode_fec = ll->link_params.fec;
+    ll->mode_payload = ll->payload;
+    ll->quality = 0;
+    ll->clean_run = 0;
+
+    size_t max_frame = rs_coded_size(ll->link_params.max_payload + FRAME_OVERHEAD, ll->fec_limit);
+
+    // either end may send and receive, the link turns around for replies
+    pool_init(&ll->tx_pool, ll->link_params.window, link_frame_size(ll));
+    pool_init(&ll->rx_pool, ll->link_params.window, ll->link_params.max_payload);
+    pool_init(&ll->send_pool, LINK_QUEUE, ll->link_params.max_payload);
+
+    // frames are destuffed in place of their stuffed length
+    reader_resize(&ll->reader, max_frame);
+    if (ll->rx_frame.size < 2 * max_frame) {
+        ll->rx_frame.array = (unsigned char *) track_realloc(ll->rx_frame.array, 2 * max_frame);
+        ll->rx_frame.size = 2 * max_frame;
+    }
+
+    if (ll->rx_batch.size < (size_t) ll->link_params.max_payload) {
+        ll->rx_batch.array = (unsigned char *) track_realloc(ll->rx_batch.array, ll->link_params.max_payload);
+        ll->rx_batch.size = ll->link_params.max_payload;
+    }
+    ll->rx_batch.used = 0;
+    ll->rx_batch_pos = 0;
+
+    ll->setup_allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+
+}
+
+static void print_mode_statistics(LinkContext* ll) {
+
+    if (!ll->link_params.adaptive) return;
+
+    printf("Mode changes: %d, ending on %d byte packets and FEC %s\n", ll->mode_changes, ll->payload, fec_name(ll->link_params.fec));
+
+    int listed = (ll->mode_changes < MODE_LOG) ? ll->mode_changes : MODE_LOG;
+    for (int i = 0; i < listed; i++) {
+
+        ModeChange* change = &ll->mode_log[i];
+
+        if (change->blamed < 0) {
+            printf("  after %d packets, asked by the peer: %d byte packets, FEC %s\n", change->packet, change->payload, fec_name(change->fec));
+        } else {
+            printf("  after %d packets, %d rejects and timeouts in the last %d outcomes, SRTT %.1f ms: %d byte packets, FEC %s\n", change->packet, change->blamed, QUALITY_WINDOW, change->srtt, change->payload, fec_name(change->fec));
+        }
+
+    }
+
+}
+
+static void print_reader_statistics(LinkContext* ll) {
+
+    double megabytes = ll->payload_bytes / (1024.0 * 1024.0);
+    double cpu_ms = (clock() - ll->cpu_start) * 1000.0 / CLOCKS_PER_SEC;
+
+    printf("read() calls: %ld for %ld bytes\n", ll->reader.read_calls, ll->reader.bytes_read);
+
+    // process wide, links striped over several threads count together
+    long allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    printf("Allocations: %ld, %ld since the link was set up\n", allocated, allocated - ll->setup_allocations);
+
+    if (megabytes > 0) {
+        printf("Allocations per MB since setup: %.1f\n", (allocated - ll->setup_allocations) / megabytes);
+        printf("read() calls per MB: %.0f\n", ll->reader.read_calls / megabytes);
+        printf("CPU time per MB: %.2f ms\n", cpu_ms / megabytes);
+    }
+
+}
@@ -0,0 +1,212 @@
+#include "rs.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define RS_POLY 0x11D
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+
+// generator of each parity count, highest degree first and without its
+// leading 1, as logarithms
+static unsigned char generator_log[RS_MAX_PARITY + 1][RS_MAX_PARITY];
+
+// products with alpha^i, one lookup per byte and syndrome
+static unsigned char alpha_mul[RS_MAX_PARITY][256];
+
+static inline unsigned char gf_mul(unsigned char a, unsigned char b) {
+    return (a == 0 || b == 0) ? 0 : gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline unsigned char gf_div(unsigned char a, unsigned char b) {
+    return (a == 0) ? 0 : gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+__attribute__((constructor))
+static void rs_tables_init(void) {
+
+    unsigned int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= RS_POLY;
+    }
+
+    // doubled so products of two logarithms need no reduction
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+    for (int i = 0; i < RS_MAX_PARITY; i++) {
+        for (int b = 0; b < 256; b++) {
+            alpha_mul[i][b] = gf_mul(b, gf_exp[i]);
+        }
+    }
+
+    for (int parity = 1; parity <= RS_MAX_PARITY; parity++) {
+
+        // multiplied out one (x - alpha^i) at a time, g[0] is the x^parity term
+        unsigned char g[RS_MAX_PARITY + 1] = { 1 };
+
+        for (int i = 0; i < parity; i++) {
+            for (int j = i + 1; j > 0; j--) {
+                g[j] ^= gf_mul(g[j - 1], gf_exp[i]);
+            }
+        }
+
+        for (int j = 0; j < parity; j++) {
+            generator_log[parity][j] = gf_log[g[j + 1]];
+        }
+
+    }
+
+}
+
+// Parity bytes of data, the remainder of data * x^parity over the generator
+void rs_encode(const unsigned char* data, size_t size, int parity, unsigned char* out) {
+
+    const unsigned char* g = generator_log[parity];
+    memset(out, 0, parity);
+
+    for (size_t i = 0; i < size; i++) {
+
+        unsigned char feedback = data[i] ^ out[0];
+
+        if (feedback == 0) {
+            memmove(out, out + 1, parity - 1);
+            out[parity - 1] = 0;
+            continue;
+        }
+
+        // shifted by one and the scaled generator added in the same pass
+        int f = gf_log[feedback];
+        for (int j = 0; j < parity - 1; j++) {
+            out[j] = out[j + 1] ^ gf_exp[f + g[j]];
+        }
+        out[parity - 1] = gf_exp[f + g[parity - 1]];
+
+    }
+
+}
+
+// Corrects up to parity / 2 bad bytes of a codeword, data followed by its
+// parity, in place. Returns how many it corrected or -1 if there were more.
+int rs_decode(unsigned char* codeword, size_t size, int parity) {
+
+    unsigned char syndromes[RS_MAX_PARITY];
+    bool clean = true;
+
+    // the codeword's first byte is its highest coefficient
+    // all of them advance a byte at a time, their chains run side by side
+    memset(syndromes, 0, parity);
+
+    for (size_t j = 0; j < size; j++) {
+        for (int i = 0; i < parity; i++) {
+            syndromes[i] = alpha_mul[i][syndromes[i]] ^ codeword[j];
+        }
+    }
+
+    for (int i = 0; i < parity; i++) {
+        if (syndromes[i] != 0) clean = false;
+    }
+
+    if (clean) return 0;
+
+    // Berlekamp-Massey, lambda ends up as the error locator
+    unsigned char lambda[RS_MAX_PARITY + 1] = { 1 };
+    unsigned char prev[RS_MAX_PARITY + 1] = { 1 };
+    unsigned char copy[RS_MAX_PARITY + 1];
+    int errors = 0;
+    int shift = 1;
+    unsigned char last = 1;
+
+    for (int n = 0; n < parity; n++) {
+
+        unsigned char d = syndromes[n];
+        for (int i = 1; i <= errors; i++) {
+            d ^= gf_mul(lambda[i], syndromes[n - i]);
+        }
+
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gf_div(d, last);
+        bool grow = 2 * errors <= n;
+        if (grow) memcpy(copy, lambda, sizeof(lambda));
+
+        for (int i = shift; i <= parity; i++) {
+            lambda[i] ^= gf_mul(scale, prev[i - shift]);
+        }
+
+        if (grow) {
+            errors = n + 1 - errors;
+            memcpy(prev, copy, sizeof(prev));
+            last = d;
+            shift = 1;
+        } else {
+            shift++;
+        }
+
+    }
+
+    if (2 * errors > parity) return -1;
+
+    // omega = syndromes * lambda mod x^parity, the error evaluator
+    unsigned char omega[RS_MAX_PARITY] = { 0 };
+    for (int i = 0; i < parity; i++) {
+        for (int j = 0; j <= i && j <= errors; j++) {
+            omega[i] ^= gf_mul(lambda[j], syndromes[i - j]);
+        }
+    }
+
+    // Chien search over the positions the shortened codeword has, Forney
+    // gives the value at each root
+    int found = 0;
+
+    for (size_t j = 0; j < size; j++) {
+
+        int power = size - 1 - j;
+        int inverse = (255 - power) % 255;
+
+        unsigned char value = 0;
+        unsigned char derivative = 0;
+
+        for (int i = 0; i <= errors; i++) {
+            if (lambda[i] == 0) continue;
+            unsigned char term = gf_exp[(gf_log[lambda[i]] + inverse * i) % 255];
+            value ^= term;
+            // in characteristic 2 only the odd terms survive differentiation
+            if (i & 1) derivative ^= gf_exp[(gf_log[lambda[i]] + inverse * (i - 1)) % 255];
+        }
+
+        if (value != 0) continue;
+        if (derivative == 0) return -1;
+
+        unsigned char evaluated = 0;
+        for (int i = parity - 1; i >= 0; i--) {
+            evaluated = gf_mul(evaluated, gf_exp[inverse]) ^ omega[i];
+        }
+
+        codeword[j] ^= gf_mul(gf_exp[power], gf_div(evaluated, derivative));
+        found++;
+
+    }
+
+    return (found == errors) ? found : -1;
+
+}
+
+// Length of size bytes once every RS_BLOCK - parity of them carry parity
+size_t rs_coded_size(size_t size, int parity) {
+
+    if (parity == 0) return size;
+
+    size_t data = RS_BLOCK - parity;
+    return size + (size + data - 1) / data * parity;
+
+}
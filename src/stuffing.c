@@ -0,0 +1,406 @@
+#include "stuffing.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STUFFING_X86
+#endif
+
+static size_t count_escapes_scalar(const unsigned char* buf, size_t size) {
+
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) {
+        count += (buf[i] == FLAG || buf[i] == ESCAPE_FLAG);
+    }
+
+    return count;
+
+}
+
+static size_t stuff_span_scalar(unsigned char* out, const unsigned char* in, size_t size) {
+
+    size_t used = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        if (in[i] == FLAG || in[i] == ESCAPE_FLAG) {
+            out[used++] = ESCAPE_FLAG;
+            out[used++] = in[i] ^ XOR_FLAG;
+        } else {
+            out[used++] = in[i];
+        }
+    }
+
+    return used;
+
+}
+
+// Copies a block whose FLAG/ESCAPE_FLAG positions are set in mask, clean runs
+// in between go out with one memcpy each
+static inline size_t stuff_block(unsigned char* out, const unsigned char* in, size_t width, unsigned int mask) {
+
+    size_t used = 0;
+    size_t last = 0;
+
+    while (mask) {
+        size_t pos = __builtin_ctz(mask);
+        memcpy(out + used, in + last, pos - last);
+        used += pos - last;
+        out[used++] = ESCAPE_FLAG;
+        out[used++] = in[pos] ^ XOR_FLAG;
+        last = pos + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out + used, in + last, width - last);
+
+    return used + width - last;
+
+}
+
+// Destuffing progress over one frame body
+typedef struct {
+    unsigned char* out;
+    const unsigned char* in;
+    size_t size;
+    size_t used;
+    size_t last;        // first raw byte not copied out yet
+    int escapes;
+    FcsMode mode;
+    uint32_t* fcs;      // NULL when only the XOR is wanted
+} Destuffer;
+
+// Copies the clean run up to end and appends extra destuffed bytes, the FCS
+// picks both up while they are still in cache
+static inline void destuff_copy(Destuffer* d, size_t end, const unsigned char* extra, size_t extra_size) {
+
+    size_t run = end - d->last;
+    unsigned char* start = d->out + d->used;
+
+    if (run > 0) memcpy(start, d->in + d->last, run);
+    if (extra_size > 0) memcpy(start + run, extra, extra_size);
+
+    d->used += run + extra_size;
+    d->last = end;
+    if (d->fcs) *d->fcs = fcs_update(d->mode, *d->fcs, start, run + extra_size);
+
+}
+
+// Resolves the escape at in[pos], false when it is not followed by
+// REPLACE_FLAG/REPLACE_ESCAPE
+static inline bool destuff_escape(Destuffer* d, size_t pos) {
+
+    if (pos < d->last || pos + 1 >= d->size) return false;
+
+    unsigned char c = d->in[pos + 1];
+    if (c != REPLACE_FLAG && c != REPLACE_ESCAPE) return false;
+
+    c ^= XOR_FLAG;
+    destuff_copy(d, pos, &c, 1);
+    d->last = pos + 2;
+    d->escapes++;
+
+    return true;
+
+}
+
+// Every escape pair turns ESCAPE_FLAG ^ c on the wire into c ^ XOR_FLAG, so
+// the XOR of the destuffed bytes follows from the raw ones and the count
+static int destuff_tail(Destuffer* d, size_t i, unsigned char x, unsigned char* bcc) {
+
+    for (; i < d->size; i++) {
+        x ^= d->in[i];
+        if (d->in[i] == ESCAPE_FLAG && !destuff_escape(d, i)) return -1;
+    }
+
+    destuff_copy(d, d->size, NULL, 0);
+    *bcc = (d->escapes & 1) ? x ^ ESCAPE_FLAG ^ XOR_FLAG : x;
+
+    return d->used;
+
+}
+
+#ifdef __SSE2__
+
+static inline unsigned int escape_mask_sse2(const unsigned char* buf) {
+
+    __m128i v = _mm_loadu_si128((const __m128i*) buf);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(FLAG)),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(ESCAPE_FLAG)));
+
+    return _mm_movemask_epi8(m);
+
+}
+
+static size_t count_escapes_sse2(const unsigned char* buf, size_t size) {
+
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        count += __builtin_popcount(escape_mask_sse2(buf + i));
+    }
+
+    return count + count_escapes_scalar(buf + i, size - i);
+
+}
+
+static size_t stuff_span_sse2(unsigned char* out, const unsigned char* in, size_t size) {
+
+    size_t used = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        used += stuff_block(out + used, in + i, 16, escape_mask_sse2(in + i));
+    }
+
+    return used + stuff_span_scalar(out + used, in + i, size - i);
+
+}
+
+static int destuff_span_sse2(Destuffer* d, unsigned char* bcc) {
+
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= d->size; i += 16) {
+
+        __m128i v = _mm_loadu_si128((const __m128i*) (d->in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ESCAPE_FLAG)));
+        acc = _mm_xor_si128(acc, v);
+
+        while (mask) {
+            if (!destuff_escape(d, i + __builtin_ctz(mask))) return -1;
+            mask &= mask - 1;
+        }
+
+        if (d->last + FCS_CHUNK <= i) destuff_copy(d, i, NULL, 0);
+
+    }
+
+    unsigned char lanes[16];
+    unsigned char x = 0;
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    for (int l = 0; l < 16; l++) x ^= lanes[l];
+
+    return destuff_tail(d, i, x, bcc);
+
+}
+
+#endif
+
+#ifdef STUFFING_X86
+
+__attribute__((target("avx2")))
+static inline unsigned int escape_mask_avx2(const unsigned char* buf) {
+
+    __m256i v = _mm256_loadu_si256((const __m256i*) buf);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(FLAG)),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ESCAPE_FLAG)));
+
+    return (unsigned int) _mm256_movemask_epi8(m);
+
+}
+
+__attribute__((target("avx2")))
+static size_t count_escapes_avx2(const unsigned char* buf, size_t size) {
+
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        count += __builtin_popcount(escape_mask_avx2(buf + i));
+    }
+
+    return count + count_escapes_scalar(buf + i, size - i);
+
+}
+
+__attribute__((target("avx2")))
+static size_t stuff_span_avx2(unsigned char* out, const unsigned char* in, size_t size) {
+
+    size_t used = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        used += stuff_block(out + used, in + i, 32, escape_mask_avx2(in + i));
+    }
+
+    return used + stuff_span_scalar(out + used, in + i, size - i);
+
+}
+
+__attribute__((target("avx2")))
+static int destuff_span_avx2(Destuffer* d, unsigned char* bcc) {
+
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= d->size; i += 32) {
+
+        __m256i v = _mm256_loadu_si256((const __m256i*) (d->in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ESCAPE_FLAG)));
+        acc = _mm256_xor_si256(acc, v);
+
+        while (mask) {
+            if (!destuff_escape(d, i + __builtin_ctz(mask))) return -1;
+            mask &= mask - 1;
+        }
+
+        if (d->last + FCS_CHUNK <= i) destuff_copy(d, i, NULL, 0);
+
+    }
+
+    unsigned char lanes[32];
+    unsigned char x = 0;
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+    for (int l = 0; l < 32; l++) x ^= lanes[l];
+
+    return destuff_tail(d, i, x, bcc);
+
+}
+
+#endif
+
+size_t count_escapes(const unsigned char* buf, size_t size) {
+
+#ifdef STUFFING_X86
+    if (__builtin_cpu_supports("avx2")) return count_escapes_avx2(buf, size);
+#endif
+#ifdef __SSE2__
+    return count_escapes_sse2(buf, size);
+#else
+    return count_escapes_scalar(buf, size);
+#endif
+
+}
+
+size_t stuff_raw(unsigned char* out, const unsigned char* in, size_t size) {
+
+#ifdef STUFFING_X86
+    if (__builtin_cpu_supports("avx2")) return stuff_span_avx2(out, in, size);
+#endif
+#ifdef __SSE2__
+    return stuff_span_sse2(out, in, size);
+#else
+    return stuff_span_scalar(out, in, size);
+#endif
+
+}
+
+// out must hold size + count_escapes(in, size) bytes. When fcs is given it
+// is advanced over the raw bytes a chunk at a time, right after stuffing them.
+size_t stuff_span(unsigned char* out, const unsigned char* in, size_t size, FcsMode mode, uint32_t* fcs) {
+
+    if (fcs == NULL) return stuff_raw(out, in, size);
+
+    size_t used = 0;
+
+    for (size_t i = 0; i < size; i += FCS_CHUNK) {
+        size_t chunk = (size - i < FCS_CHUNK) ? size - i : FCS_CHUNK;
+        used += stuff_raw(out + used, in + i, chunk);
+        *fcs = fcs_update(mode, *fcs, in + i, chunk);
+    }
+
+    return used;
+
+}
+
+// Destuffs a whole frame body into out (at most size bytes). bcc gets the
+// XOR of the destuffed bytes and fcs, when given, is advanced over them.
+// Returns the destuffed size, or -1 on a broken escape.
+int destuff_span(unsigned char* out, const unsigned char* in, size_t size, unsigned char* bcc, FcsMode mode, uint32_t* fcs) {
+
+    Destuffer d = { out, in, size, 0, 0, 0, mode, fcs };
+
+#ifdef STUFFING_X86
+    if (__builtin_cpu_supports("avx2")) return destuff_span_avx2(&d, bcc);
+#endif
+#ifdef __SSE2__
+    return destuff_span_sse2(&d, bcc);
+#else
+    return destuff_tail(&d, 0, 0, bcc);
+#endif
+
+}
+
+// The XOR mask that leaves the fewest bytes to stuff in data and in the
+// header in front of it, found from one histogram of the data. header is the
+// unmasked A C N(S) BCC1, masked_C the control byte the header takes instead
+// when masked, it then grows by the mask byte and a BCC1 of its own. The FCS
+// is left out, it is only known once it ran over the masked data and can sway
+// the count by no more than its own size. Returns 0 when no mask beats
+// sending the data as it is, saved gets how many stuffed bytes the mask takes
+// off the frame.
+unsigned char pick_mask(const struct iovec* iov, int iovcnt, const unsigned char* header, int header_size, unsigned char masked_C, size_t* saved) {
+
+    size_t escapes = count_escapes(header, header_size);
+    for (int k = 0; k < iovcnt; k++) {
+        escapes += count_escapes(iov[k].iov_base, iov[k].iov_len);
+    }
+
+    // the mask byte alone costs one, so a mask has to take two escapes away
+    *saved = 0;
+    if (escapes < 2) return 0;
+
+    // four tables, so runs of one value do not wait on each other's increments
+    uint32_t counts[4][256] = { { 0 } };
+
+    for (int k = 0; k < iovcnt; k++) {
+
+        const unsigned char* buf = iov[k].iov_base;
+        size_t size = iov[k].iov_len;
+        size_t i = 0;
+
+        for (; i + 4 <= size; i += 4) {
+            counts[0][buf[i]]++;
+            counts[1][buf[i + 1]]++;
+            counts[2][buf[i + 2]]++;
+            counts[3][buf[i + 3]]++;
+        }
+
+        for (; i < size; i++) {
+            counts[0][buf[i]]++;
+        }
+
+    }
+
+    // A, C and N(S) of the masked header, laid out as masked_header_create() does
+    unsigned char fixed[3] = { SET_A, masked_C, header[2] };
+    size_t fixed_cost = count_escapes(fixed, 3);
+    unsigned char bcc1 = SET_A ^ masked_C ^ header[2];
+
+    unsigned char best = 0;
+    size_t best_cost = escapes;
+
+    for (int mask = 1; mask < 256; mask++) {
+
+        // masked, the bytes that need escaping are the ones equal to
+        // FLAG ^ mask and ESCAPE_FLAG ^ mask beforehand
+        size_t cost = 1 + fixed_cost;
+        for (int t = 0; t < 4; t++) {
+            cost += counts[t][FLAG ^ mask] + counts[t][ESCAPE_FLAG ^ mask];
+        }
+
+        // the mask byte and the BCC1 it changes are stuffed like any other
+        unsigned char added[2] = { mask, bcc1 ^ mask };
+        cost += count_escapes(added, 2);
+
+        if (cost < best_cost) {
+            best = mask;
+            best_cost = cost;
+        }
+
+    }
+
+    *saved = escapes - best_cost;
+    return best;
+
+}
+
+// out gets in XOR mask, out may be in
+void xor_mask(unsigned char* out, const unsigned char* in, size_t size, unsigned char mask) {
+
+    for (size_t i = 0; i < size; i++) {
+        out[i] = in[i] ^ mask;
+    }
+
+}
@@ -1,4 +1,7 @@
 #include "utils.h"
+#include "stuffing.h"
+#include <errno.h>
+#include <sys/stat.h>
 
 void sender_block_create(unsigned char block[5]) {
 
@@ -30,18 +33,26 @@ void command_block_create(unsigned char block[5], unsigned char command) {
 
 }
 
-void response_block_create(unsigned char block[5], unsigned char response, bool packet_switch) {
-    
-    block[0] = FLAG;
-    block[1] = SET_A;
+int response_block_create(unsigned char block[SUPERVISORY_MAX], unsigned char response, int nr, const LinkParams* params) {
 
-    unsigned char C;
-    if (packet_switch) C = response;
-    else C = (response | BIT(7));
+    unsigned char header[4];
+    int header_size;
 
-    block[2] = C;
-    block[3] = SET_A ^ C;
-    block[4] = FLAG;
+    if (params->arq == ARQ_STOP_AND_WAIT) {
+        // legacy peers tag REJ with the bit they are still waiting on, inverted
+        int bit = (response == REJ_C) ? (nr ^ 1) : nr;
+        header_size = info_header_create(header, response | (bit << 7), 0, false);
+    } else {
+        header_size = info_header_create(header, response, nr, true);
+    }
+
+    // the sequence byte and BCC1 can take any value, so they get stuffed
+    int size = 0;
+    block[size++] = FLAG;
+    size += stuff_raw(block + size, header, header_size);
+    block[size++] = FLAG;
+
+    return size;
 
 }
 
@@ -57,9 +68,19 @@ long get_file_size(FILE* file_stream) {
 
 }
 
+// every heap allocation the transfer makes goes through here, from any thread
+long allocations = 0;
+
+void* track_realloc(void* ptr, size_t size) {
+
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+
+}
+
 void init_array(Array* a, size_t init_size) {
 
-    a->array = (unsigned char *) malloc(sizeof(unsigned char) * init_size);
+    a->array = (unsigned char *) track_realloc(NULL, sizeof(unsigned char) * init_size);
     a->size = init_size;
     a->used = 0;
 
@@ -69,7 +90,7 @@ void insert_array(Array* a, char element) {
 
     if (a->used == a->size) {
         a->size *= 2;
-        a->array = (unsigned char *) realloc(a->array, sizeof(unsigned char) * a->size);
+        a->array = (unsigned char *) track_realloc(a->array, sizeof(unsigned char) * a->size);
     }
 
     a->array[a->used++] = element;
@@ -78,7 +99,7 @@ void insert_array(Array* a, char element) {
 
 void insert_long(Array* a, long element) {
     
-    for (int i = 7; i == 0; i--) {
+    for (int i = sizeof(element) - 1; i >= 0; i--) {
         insert_array(a, (unsigned char) (element >> i*8));
     }
 
@@ -86,7 +107,7 @@ void insert_long(Array* a, long element) {
 
 void insert_char_pointer(Array* a, const char * element) {
 
-    for (int i = 0; i < strlen(element); i++) {
+    for (size_t i = 0; i < strlen(element); i++) {
         insert_array(a, element[i]);
     }
 
@@ -107,7 +128,7 @@ void free_array(Array* a) {
     a->size = 0;
 }
 
-void start_packet_create(Array* a, const char* filename, long file_size) {
+void start_packet_create(Array* a, const char* filename, long file_size, const Compression* compression, bool batch, bool resume, int stripes) {
 
     insert_array(a, START_PACKET_C);
     insert_array(a, FILENAME_PACKET_T);
@@ -117,6 +138,32 @@ void start_packet_create(Array* a, const char* filename, long file_size) {
     insert_array(a, sizeof(file_size));
     insert_long(a, file_size);
 
+    // left out when uncompressed, so older receivers still take the packet
+    if (compression->mode != COMPRESS_NONE) {
+        insert_array(a, COMPRESSION_PACKET_T);
+        insert_array(a, 5);
+        insert_array(a, compression->mode);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            insert_array(a, compression->block_size >> shift);
+        }
+    }
+
+    if (batch) {
+        insert_array(a, BATCH_PACKET_T);
+        insert_array(a, 0);
+    }
+
+    if (resume) {
+        insert_array(a, RESUME_PACKET_T);
+        insert_array(a, 0);
+    }
+
+    if (stripes > 1) {
+        insert_array(a, STRIPE_PACKET_T);
+        insert_array(a, 1);
+        insert_array(a, stripes);
+    }
+
 }
 
 void end_packet_create(Array* a, const char* filename, long file_size) {
@@ -131,84 +178,244 @@ void end_packet_create(Array* a, const char* filename, long file_size) {
 
 }
 
-void data_packet_create(Array* a, int order, int bytes_read, unsigned char buffer[]) {
+void data_packet_header(unsigned char header[PACKET_HEADER_SIZE], int order, int bytes_read) {
+
+    header[0] = DATA_PACKET_C;
+    header[1] = order;
+    header[2] = bytes_read / 256;
+    header[3] = bytes_read % 256;
+
+}
+
+void stripe_packet_header(unsigned char header[STRIPE_HEADER_SIZE], int order, int bytes_read, long offset) {
+
+    data_packet_header(header, order, bytes_read);
+    header[0] = STRIPE_PACKET_C;
 
-    insert_array(a, DATA_PACKET_C);
-    insert_array(a, order);
-    insert_array(a, bytes_read / 256);
-    insert_array(a, bytes_read % 256);
-    insert_uchar_pointer(a, buffer, bytes_read);
+    for (int i = 0; i < 8; i++) {
+        header[PACKET_HEADER_SIZE + i] = offset >> (56 - 8 * i);
+    }
 
 }
 
-int parse_start_packet(Array* a, Array* rcv_filename, Filesize* rcv_filesize) {
+int parse_start_packet(Array* a, Array* rcv_filename, Filesize* rcv_filesize, Compression* rcv_compression, bool* rcv_batch, bool* rcv_resume, int* rcv_stripes) {
 
     if (a->array[0] != START_PACKET_C) {
         return -1;
     }
 
-    // READ THE FILENAME AND WRITE IT TO rcv_filename
-    int filename_size = a->array[2];
-    
-    for (int i = 0; i < filename_size; i++) {
-        insert_array(rcv_filename, a->array[i+3]);
+    rcv_compression->mode = COMPRESS_NONE;
+    rcv_compression->block_size = 0;
+    *rcv_batch = false;
+    *rcv_resume = false;
+    *rcv_stripes = 1;
+
+    size_t i = 1;
+    while (i + 2 <= a->used) {
+
+        unsigned char T = a->array[i];
+        unsigned char L = a->array[i+1];
+        unsigned char* V = a->array + i + 2;
+
+        // older transmitters announce the size without sending it, the size stays unknown
+        if (i + 2 + L > a->used) break;
+
+        switch (T) {
+            case FILENAME_PACKET_T:
+                for (int j = 0; j < L; j++) {
+                    insert_array(rcv_filename, V[j]);
+                }
+                insert_array(rcv_filename, '\0');
+                break;
+            case SIZE_PACKET_T:
+                if (L > sizeof(Filesize)) break;
+                for (int j = 0; j < L; j++) {
+                    rcv_filesize->array[(L-1) - j] = V[j];
+                }
+                break;
+            case COMPRESSION_PACKET_T:
+                // data we cannot expand is no use, so the transfer stops here
+                if (L != 5 || V[0] != COMPRESS_LZ) return -1;
+                rcv_compression->mode = V[0];
+                rcv_compression->block_size = 0;
+                for (int j = 1; j < 5; j++) {
+                    rcv_compression->block_size = (rcv_compression->block_size << 8) | V[j];
+                }
+                if (rcv_compression->block_size <= 0 || rcv_compression->block_size > LZ_MAX_BLOCK) return -1;
+                break;
+            case BATCH_PACKET_T:
+                *rcv_batch = true;
+                break;
+            case RESUME_PACKET_T:
+                *rcv_resume = true;
+                break;
+            case STRIPE_PACKET_T:
+                if (L == 1) *rcv_stripes = V[0];
+                break;
+            default:
+                break;
+        }
+
+        i += 2 + L;
     }
 
-    // READ THE FILESIZE AND WRITE IT TO rcv_filesize
-    int filesize_size = a->array[filename_size+4];
+    return 0;
+}
 
-    for (int i = 0; i < filesize_size; i++) {
-        rcv_filesize->array[(filesize_size-1) - i] = a->array[i+filename_size+5];
+void resume_packet_create(Array* a, long offset, uint32_t checksum) {
+
+    insert_array(a, RESUME_PACKET_C);
+    insert_array(a, OFFSET_PACKET_T);
+    insert_array(a, sizeof(offset));
+    insert_long(a, offset);
+    insert_array(a, CHECKSUM_PACKET_T);
+    insert_array(a, 4);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        insert_array(a, checksum >> shift);
     }
 
+}
+
+int parse_resume_packet(unsigned char* packet, int size, long* offset, uint32_t* checksum) {
+
+    if (size < 1 || packet[0] != RESUME_PACKET_C) return -1;
+
+    *offset = 0;
+    *checksum = 0;
+
+    int i = 1;
+    while (i + 2 <= size) {
+
+        unsigned char T = packet[i];
+        unsigned char L = packet[i+1];
+        unsigned char* V = packet + i + 2;
+
+        if (i + 2 + L > size) return -1;
+
+        for (int j = 0; j < L; j++) {
+            if (T == OFFSET_PACKET_T) *offset = (*offset << 8) | V[j];
+            if (T == CHECKSUM_PACKET_T) *checksum = (*checksum << 8) | V[j];
+        }
+
+        i += 2 + L;
+    }
+
+    return *offset < 0 ? -1 : 0;
+
+}
+
+// CRC-32 of the first size bytes of fd, both ends run it over the part already transferred
+int file_checksum(int fd, long size, uint32_t* checksum) {
+
+    unsigned char buffer[65536];
+    uint32_t crc = fcs_init(FCS_CRC32);
+
+    for (long offset = 0; offset < size; ) {
+
+        long chunk = (size - offset < (long) sizeof(buffer)) ? size - offset : (long) sizeof(buffer);
+        ssize_t bytes = pread(fd, buffer, chunk, offset);
+        if (bytes <= 0) return -1;
+
+        crc = fcs_update(FCS_CRC32, crc, buffer, bytes);
+        offset += bytes;
+
+    }
+
+    *checksum = crc;
     return 0;
+
 }
 
+// name-received.ext, where .ext is whatever follows the last '.' of the last
+// path component. Names without one, or hidden files, just get -received.
 void create_filename(Array* s, Array* rcv_filename) {
-    unsigned char* fname = rcv_filename->array;
-    char* beg = strtok((char*) fname, ".");
-    char* end = strtok(NULL, ".");
 
-    char name[strlen(beg)];
-    char term[strlen(end)];
-    
-    strcpy(name, beg);
-    strcpy(term, end);
-    char* str = strcat(strcat(name,"-received."), term);
-    
-    insert_char_pointer(s, str);
+    const char* fname = (const char*) rcv_filename->array;
+    const char* base = strrchr(fname, '/');
+    base = (base != NULL) ? base + 1 : fname;
+
+    const char* dot = strrchr(base, '.');
+    if (dot == base) dot = NULL;
+
+    int stem = (dot != NULL) ? dot - fname : (int) strlen(fname);
+    char name[strlen(fname) + sizeof("-received")];
+    snprintf(name, sizeof(name), "%.*s-received%s", stem, fname, dot != NULL ? dot : "");
+
+    insert_char_pointer(s, name);
+    insert_array(s, '\0');
 }
 
-void get_buffer(Array* a, Array* buffer, int size) {
+// Files of a batch keep their path below dir. Names that could leave it are refused.
+int batch_filename(Array* s, const char* dir, Array* rcv_filename) {
 
-    for (int i = 0; i < size; i++) {
-        insert_array(buffer, a->array[4+i]);
+    const char* name = (const char*) rcv_filename->array;
+    if (rcv_filename->used == 0 || name[0] == '\0' || name[0] == '/') return -1;
+
+    for (const char* c = name; *c != '\0'; c = strchr(c, '/') ? strchr(c, '/') + 1 : c + strlen(c)) {
+        if (strncmp(c, "..", 2) == 0 && (c[2] == '/' || c[2] == '\0')) return -1;
     }
-    
+
+    insert_char_pointer(s, dir);
+    insert_array(s, '/');
+    insert_char_pointer(s, name);
+    insert_array(s, '\0');
+
+    return 0;
+
 }
 
-void bstuff(Array* a, Array* b) {
-    int N = 0;
-    while (N < a->used) {
-
-        if (a->array[N] == FLAG) {
-
-            insert_array(b, ESCAPE_FLAG);
-            insert_array(b, REPLACE_FLAG);
-        
-        } else if (a->array[N] == ESCAPE_FLAG) {
-        
-            insert_array(b, ESCAPE_FLAG);
-            insert_array(b, REPLACE_ESCAPE);
-        
-        } else {
-        
-            insert_array(b, a->array[N]);
-        
+// mkdir -p of everything before the last slash
+int make_parents(char* path) {
+
+    for (char* c = strchr(path + 1, '/'); c != NULL; c = strchr(c + 1, '/')) {
+
+        *c = '\0';
+        int result = mkdir(path, 0755);
+        *c = '/';
+
+        if (result != 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
         }
-        N++;
+
+    }
+
+    return 0;
+
+}
+
+void insert_stuffed(Array* a, unsigned char element) {
+
+    if (element == FLAG) {
+
+        insert_array(a, ESCAPE_FLAG);
+        insert_array(a, REPLACE_FLAG);
+
+    } else if (element == ESCAPE_FLAG) {
+
+        insert_array(a, ESCAPE_FLAG);
+        insert_array(a, REPLACE_ESCAPE);
+
+    } else {
+
+        insert_array(a, element);
+
     }
 
+}
+
+// fcs, when given, is advanced over a in the same pass
+void bstuff(Array* a, Array* b, FcsMode mode, uint32_t* fcs) {
+
+    // b grows at most once, to the exact stuffed size
+    size_t needed = b->used + a->used + count_escapes(a->array, a->used);
+    if (b->size < needed) {
+        b->array = (unsigned char *) track_realloc(b->array, sizeof(unsigned char) * needed);
+        b->size = needed;
+    }
+
+    b->used += stuff_span(b->array + b->used, a->array, a->used, mode, fcs);
+
     free_array(a);
 
 }
@@ -225,33 +432,329 @@ unsigned char bdestuff(unsigned char a) {
 
 }
 
-void attach_info_frame(Array* buf, bool packet_switch) {
+void frame_header_create(Array* packet, unsigned char C, int seq, bool extended) {
+
+    unsigned char header[4];
+    int size = info_header_create(header, C, seq, extended);
+
+    insert_array(packet, FLAG);
+
+    // the sequence byte and BCC1 can take any value, so they get stuffed
+    for (int i = 0; i < size; i++) {
+        insert_stuffed(packet, header[i]);
+    }
+
+}
+
+// Unstuffed A, C, N(S) and BCC1, the FCS starts over these
+int info_header_create(unsigned char header[4], unsigned char C, int seq, bool extended) {
 
-    Array aux;
-    init_array(&aux, buf->size);
-    frame_header_create(&aux, packet_switch);
+    header[0] = SET_A;
+    header[1] = C;
 
-    for (int i = 0; i < buf->used; i++) {
-        insert_array(&aux, buf->array[i]);
+    if (extended) {
+        header[2] = seq;
+        header[3] = SET_A ^ C ^ seq;
+        return 4;
     }
 
-    insert_array(&aux, FLAG);
+    header[2] = SET_A ^ C;
+    return 3;
+
+}
 
-    buf->array = aux.array;
-    buf->size = aux.size;
-    buf->used = aux.used;
+// Same for a masked I-frame, which carries its mask between N(S) and BCC1
+int masked_header_create(unsigned char header[5], unsigned char C, int seq, unsigned char mask) {
+
+    header[0] = SET_A;
+    header[1] = C;
+    header[2] = seq;
+    header[3] = mask;
+    header[4] = SET_A ^ C ^ seq ^ mask;
+    return 5;
 
 }
 
-void frame_header_create(Array* packet, bool packet_switch) {
+// bcc is the XOR of every byte in the frame. With a good BCC1 the header
+// cancels itself out, so it is zero exactly when BCC2 matches the data.
+// Extended information frames use fcs instead when it was run in a CRC mode.
+int parse_frame(Array* frame, unsigned char bcc, uint32_t fcs, FcsMode mode, Frame* out) {
+
+    unsigned char* f = frame->array;
+    int header_size;
+
+    if (frame->used < 3 || (f[0] != SET_A && f[0] != UA_A)) return -1;
+
+    out->data = NULL;
+    out->size = 0;
+    out->valid_data = true;
+    out->extended = false;
+    out->aggregated = false;
+    out->mask = 0;
+    out->repaired = false;
+    out->seq = 0;
+
+    if (f[1] == WRITE_EXT_C || f[1] == WRITE_AGG_C) {
+
+        if (frame->used < 5 || f[3] != (f[0] ^ f[1] ^ f[2])) return -1;
+        out->control = WRITE_C;
+        out->seq = f[2];
+        out->extended = true;
+        out->aggregated = (f[1] == WRITE_AGG_C);
+        header_size = 4;
+
+    } else if (f[1] == WRITE_MASK_C || f[1] == WRITE_MASK_AGG_C) {
+
+        // the mask follows N(S), A C N(S) M BCC1
+        if (frame->used < 6 || f[4] != (f[0] ^ f[1] ^ f[2] ^ f[3])) return -1;
+        out->control = WRITE_C;
+        out->seq = f[2];
+        out->extended = true;
+        out->aggregated = (f[1] == WRITE_MASK_AGG_C);
+        out->mask = f[3];
+        header_size = 5;
+
+    } else if ((f[1] & ~BIT(6)) == WRITE_C) {
+
+        if (f[2] != (f[0] ^ f[1]) || frame->used < 4) return -1;
+        out->control = WRITE_C;
+        out->seq = f[1] >> 6;
+        header_size = 3;
+
+    } else if (frame->used == 4) {
+
+        // extended supervisory frame, A C N(R) BCC1
+        if (f[3] != (f[0] ^ f[1] ^ f[2])) return -1;
+        out->control = f[1];
+        out->seq = f[2] & ~NR_REPAIRED;
+        out->repaired = (f[1] == RR_C && (f[2] & NR_REPAIRED));
+        out->extended = true;
+        return 0;
+
+    } else {
+
+        if (f[2] != (f[0] ^ f[1])) return -1;
+        out->control = f[1];
+
+        if ((f[1] & ~BIT(7)) == RR_C || (f[1] & ~BIT(7)) == REJ_C) {
+            out->control = f[1] & ~BIT(7);
+            out->seq = f[1] >> 7;
+            if (out->control == REJ_C) out->seq ^= 1;
+        }
 
-    insert_array(packet, FLAG);
-    insert_array(packet, SET_A);
+        if (f[1] != XID_C && f[1] != MODE_C) return 0;
+        header_size = 3;
+
+    }
 
-    unsigned char C = 0;
-    if (packet_switch) C |= BIT(6);
-    insert_array(packet, C);
+    int trailer_size = (out->extended && out->control == WRITE_C) ? fcs_size(mode) : 1;
+
+    if (frame->used < (size_t) (header_size + trailer_size)) {
+        out->valid_data = false;
+        return 0;
+    }
 
-    insert_array(packet, SET_A^C);
+    out->data = f + header_size;
+    out->size = frame->used - header_size - trailer_size;
+    out->valid_data = (trailer_size == 1) ? (bcc == 0) : fcs_check(mode, fcs);
+
+    return 0;
+
+}
+
+void xid_frame_create(Array* a, const LinkParams* params) {
+
+    Array body;
+    init_array(&body, 8);
+
+    insert_array(&body, XID_ARQ_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->arq);
+    insert_array(&body, XID_WINDOW_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->window);
+    insert_array(&body, XID_FCS_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->fcs);
+    insert_array(&body, XID_PAYLOAD_T);
+    insert_array(&body, 4);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        insert_array(&body, params->max_payload >> shift);
+    }
+    insert_array(&body, XID_FEC_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->fec);
+    insert_array(&body, XID_ADAPT_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->adaptive);
+    insert_array(&body, XID_AGGREGATE_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->aggregate);
+    insert_array(&body, XID_MASK_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->mask);
+    insert_array(&body, XID_COMPRESS_T);
+    insert_array(&body, 1);
+    insert_array(&body, params->compress);
+
+    unsigned char bcc2 = 0;
+    for (size_t i = 0; i < body.used; i++) {
+        bcc2 ^= body.array[i];
+    }
+    insert_array(&body, bcc2);
+
+    frame_header_create(a, XID_C, 0, false);
+    bstuff(&body, a, FCS_XOR, NULL);
+    insert_array(a, FLAG);
+
+}
+
+void parse_xid(Frame* frame, LinkParams* params) {
+
+    // peers that predate a parameter never send it
+    params->fcs = FCS_XOR;
+    params->max_payload = LEGACY_MAX_PAYLOAD;
+    params->fec = 0;
+    params->adaptive = false;
+    params->aggregate = false;
+    params->mask = false;
+    params->compress = COMPRESS_NONE;
+
+    int i = 0;
+    while (i + 1 < frame->size) {
+
+        unsigned char T = frame->data[i];
+        unsigned char L = frame->data[i+1];
+        unsigned char* V = frame->data + i + 2;
+
+        if (i + 2 + L > frame->size) break;
+
+        // unknown parameters are skipped so newer peers can add their own
+        switch (T) {
+            case XID_ARQ_T:
+                params->arq = V[0];
+                break;
+            case XID_WINDOW_T:
+                params->window = V[0];
+                break;
+            case XID_FCS_T:
+                params->fcs = V[0];
+                break;
+            case XID_PAYLOAD_T:
+                params->max_payload = 0;
+                for (int j = 0; j < L; j++) {
+                    params->max_payload = (params->max_payload << 8) | V[j];
+                }
+                break;
+            case XID_FEC_T:
+                params->fec = V[0];
+                break;
+            case XID_ADAPT_T:
+                params->adaptive = V[0];
+                break;
+            case XID_AGGREGATE_T:
+                params->aggregate = V[0];
+                break;
+            case XID_MASK_T:
+                params->mask = V[0];
+                break;
+            case XID_COMPRESS_T:
+                params->compress = V[0];
+                break;
+            default:
+                break;
+        }
+
+        i += 2 + L;
+    }
+
+    params->modulus = (params->arq == ARQ_STOP_AND_WAIT) ? LEGACY_MODULUS : EXT_MODULUS;
+
+}
+
+void negotiate_params(LinkParams* own, const LinkParams* peer) {
+
+    if (peer->arq < own->arq) own->arq = peer->arq;
+    if (peer->window < own->window) own->window = peer->window;
+    if (peer->fcs < own->fcs) own->fcs = peer->fcs;
+    if (peer->max_payload < own->max_payload) own->max_payload = peer->max_payload;
+    if (peer->fec < own->fec) own->fec = peer->fec;
+    own->adaptive = own->adaptive && peer->adaptive;
+    own->aggregate = own->aggregate && peer->aggregate;
+    own->mask = own->mask && peer->mask;
+    if (peer->compress < own->compress) own->compress = peer->compress;
+
+    if (own->window < 1) own->window = 1;
+    if (own->window > MAX_WINDOW) own->window = MAX_WINDOW;
+    if (own->arq == ARQ_SELECTIVE_REPEAT && own->window > MAX_SR_WINDOW) own->window = MAX_SR_WINDOW;
+
+    if (own->fcs > FCS_CRC32C) own->fcs = FCS_XOR;
+    if (own->compress > COMPRESS_NEWEST) own->compress = COMPRESS_NONE;
+
+    if (own->max_payload < LEGACY_MAX_PAYLOAD) own->max_payload = LEGACY_MAX_PAYLOAD;
+    if (own->max_payload > MAX_FRAME_PAYLOAD) own->max_payload = MAX_FRAME_PAYLOAD;
+
+    // an even count, every two parity bytes repair one
+    own->fec &= ~1;
+    if (own->fec < FEC_MIN_PARITY) own->fec = 0;
+    if (own->fec > RS_MAX_PARITY) own->fec = RS_MAX_PARITY;
+
+    if (own->arq == ARQ_STOP_AND_WAIT) {
+        own->window = 1;
+        own->modulus = LEGACY_MODULUS;
+        own->fcs = FCS_XOR;
+        own->max_payload = LEGACY_MAX_PAYLOAD;
+        own->fec = 0;
+        own->adaptive = false;
+        own->aggregate = false;
+        own->mask = false;
+    } else {
+        own->modulus = EXT_MODULUS;
+    }
+
+}
+
+// MODE frame, A C BCC1 then the FEC level and the payload asked for as
+// 3 bytes and BCC2. Short enough to never be taken for a coded frame.
+void mode_frame_create(Array* a, int fec, int payload) {
+
+    unsigned char body[5] = { fec, payload >> 16, payload >> 8, payload, 0 };
+    body[4] = body[0] ^ body[1] ^ body[2] ^ body[3];
+
+    frame_header_create(a, MODE_C, 0, false);
+    for (int i = 0; i < 5; i++) {
+        insert_stuffed(a, body[i]);
+    }
+    insert_array(a, FLAG);
+
+}
+
+int parse_mode(Frame* frame, int* fec, int* payload) {
+
+    if (!frame->valid_data || frame->size != 4) return -1;
+
+    *fec = frame->data[0];
+    *payload = (frame->data[1] << 16) | (frame->data[2] << 8) | frame->data[3];
+    return 0;
+
+}
+
+const char* fec_name(int fec) {
+
+    static char name[32];
+
+    if (fec == 0) return "none";
+    snprintf(name, sizeof(name), "RS(%d,%d)", RS_BLOCK, RS_BLOCK - fec);
+    return name;
+
+}
+
+const char* arq_name(ArqMode arq) {
+
+    switch (arq) {
+        case ARQ_GO_BACK_N: return "go-back-n";
+        case ARQ_SELECTIVE_REPEAT: return "selective repeat";
+        default: return "stop-and-wait";
+    }
 
 }
@@ -0,0 +1,50 @@
+# Joins two pseudo terminals into a null modem cable for the tests.
+#
+# usage: bridge.py DIR
+# links DIR/ttyA and DIR/ttyB to the two ends, RATE limits the line in
+# bytes per second (0 for no limit) and BER flips that fraction of bits,
+# drawn from SEED so a failing run can be repeated. STALL holds the line
+# for that many ms after every STALL_EVERY bytes, 64 KiB by default.
+
+import os, pty, random, select, sys, time, tty
+
+rate = int(os.environ.get("RATE", "0"))
+ber = float(os.environ.get("BER", "0"))
+rng = random.Random(int(os.environ.get("SEED", "1")))
+stall = float(os.environ.get("STALL", "0")) / 1000
+stall_every = int(os.environ.get("STALL_EVERY", str(64 * 1024)))
+
+ends = []
+for name in ("ttyA", "ttyB"):
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    link = os.path.join(sys.argv[1], name)
+    if os.path.lexists(link):
+        os.unlink(link)
+    os.symlink(os.ttyname(slave), link)
+    ends.append((master, slave))
+
+a, b = ends[0][0], ends[1][0]
+carried = 0
+
+def corrupt(data):
+    if ber == 0:
+        return data
+    data = bytearray(data)
+    bit = int(rng.expovariate(ber))
+    while bit < len(data) * 8:
+        data[bit // 8] ^= 1 << (bit % 8)
+        bit += 1 + int(rng.expovariate(ber))
+    return bytes(data)
+
+while True:
+    ready, _, _ = select.select([a, b], [], [])
+    for end in ready:
+        data = os.read(end, 4096)
+        os.write(b if end == a else a, corrupt(data))
+        if rate > 0:
+            time.sleep(len(data) / rate)
+        carried += len(data)
+        if stall > 0 and carried >= stall_every:
+            carried = 0
+            time.sleep(stall)
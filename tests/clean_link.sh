@@ -0,0 +1,19 @@
+#!/bin/bash
+# A clean line has nothing to recover from: the file has to arrive intact
+# without the retransmission timer running out on the way, and the quality
+# monitor has to leave the link in its first mode, without FEC.
+#
+# usage: tests/clean_link.sh
+# RATE sets the line speed in bytes per second, 1 MB/s by default.
+
+source "$(dirname "$0")/lib.sh"
+
+RATE=${RATE:-1000000} transfer 1000000
+
+timeouts=$(statistic "Retransmission timeouts")
+[ -n "$timeouts" ] || fail "no timeout count in the statistics"
+[ "$timeouts" -le 1 ] || fail "$timeouts retransmission timeouts on a clean line"
+
+clean_mode
+
+echo "PASS: $timeouts retransmission timeouts, no mode changes"
@@ -0,0 +1,51 @@
+# Shared by the link tests: builds the program into a scratch directory and
+# runs one transfer over tests/bridge.py, which reads RATE, BER, SEED and
+# STALL from the environment.
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+work=$(mktemp -d)
+bridge=
+
+fail() {
+    echo "FAIL: $1"
+    tail -n 20 "$work/tx.log" "$work/rx.log" 2>/dev/null
+    exit 1
+}
+
+trap '[ -n "$bridge" ] && kill $bridge; rm -rf "$work"' EXIT
+
+gcc -Wall -O2 -o "$work/main" "$root/main.c" "$root"/src/*.c -I"$root/include" -lpthread || fail "build"
+
+# transfer SIZE: sends SIZE random bytes and checks they arrived intact
+transfer() {
+
+    head -c "$1" /dev/urandom > "$work/data.bin"
+
+    python3 "$here/bridge.py" "$work" & bridge=$!
+    while [ ! -e "$work/ttyB" ]; do sleep 0.1; done
+
+    cd "$work"
+    timeout 120 ./main "$work/ttyB" rx data.bin > rx.log 2>&1 & receiver=$!
+    sleep 0.3
+    timeout 120 ./main "$work/ttyA" tx data.bin > tx.log 2>&1 || fail "transmitter exited with $?"
+    wait $receiver || fail "receiver exited with $?"
+
+    cmp -s data.bin data-received.bin || fail "received file differs"
+
+}
+
+# statistic NAME: the value the transmitter printed after "NAME: "
+statistic() {
+    sed -n "s/^$1: //p" "$work/tx.log"
+}
+
+# clean_mode: the quality monitor found nothing to protect against
+clean_mode() {
+    local mode=$(statistic "Mode changes")
+    [ -n "$mode" ] || fail "no mode statistics"
+    case "$mode" in
+        "0, ending on "*" and FEC none") ;;
+        *) fail "mode changes on a clean line: $mode" ;;
+    esac
+}
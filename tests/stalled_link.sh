@@ -0,0 +1,19 @@
+#!/bin/bash
+# A line that stops for a while now and then but never damages a byte: the
+# retransmission timer runs out, yet nothing was lost, so the quality
+# monitor must not raise FEC or shrink frames over it.
+#
+# usage: tests/stalled_link.sh
+# STALL sets the pause in ms, 200 by default.
+
+source "$(dirname "$0")/lib.sh"
+
+RATE=${RATE:-1000000} STALL=${STALL:-200} transfer 1000000
+
+timeouts=$(statistic "Retransmission timeouts")
+[ -n "$timeouts" ] || fail "no timeout count in the statistics"
+[ "$timeouts" -gt 0 ] || fail "the stalls never ran the retransmission timer out"
+
+clean_mode
+
+echo "PASS: $timeouts retransmission timeouts, no mode changes"